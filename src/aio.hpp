@@ -0,0 +1,282 @@
+#ifndef __AIO_H__
+#define __AIO_H__
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include "config.hpp"
+#include <cstring>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define EXT2M_HAVE_IO_URING
+#endif
+#endif
+
+/**
+ * @brief One read or write of consecutive blocks.
+ * Either a single block from/to buf, or iovcnt buffers (each a multiple of BLOCK_SIZE) starting at block_num.
+ */
+struct io_request
+{
+    bool write;
+    unsigned block_num;
+    void *buf;
+    const iovec *iov = nullptr;
+    int iovcnt = 0;
+};
+
+/**
+ * @brief Asynchronous block I/O engine.
+ * A batch of requests is in flight at the same time, they may complete in any order.
+ */
+class IOEngine
+{
+public:
+    virtual ~IOEngine() {}
+    /**
+     * @brief Submit the requests and wait until all of them have completed.
+     *
+     * @param reqs
+     * @param n
+     */
+    virtual void submit(const io_request *reqs, size_t n) = 0;
+    virtual const char *name() const = 0;
+};
+
+/**
+ * @brief Runs the requests on a few worker threads, each doing blocking I/O.
+ * Used when io_uring is not available.
+ */
+class ThreadPoolEngine : public IOEngine
+{
+private:
+    struct task
+    {
+        const io_request *req;
+        size_t *remaining;
+    };
+    std::function<void(const io_request &)> _exec;
+    std::vector<std::thread> _workers;
+    std::deque<task> _queue;
+    std::mutex _mtx;
+    std::condition_variable _work_cv;
+    std::condition_variable _done_cv;
+    bool _stop = false;
+
+    void _worker()
+    {
+        while (true)
+        {
+            std::unique_lock<std::mutex> lock(_mtx);
+            _work_cv.wait(lock, [this]
+                          { return _stop or !_queue.empty(); });
+            if (_queue.empty())
+                return;
+            auto t = _queue.front();
+            _queue.pop_front();
+            lock.unlock();
+            _exec(*t.req);
+            lock.lock();
+            if (--*t.remaining == 0)
+                _done_cv.notify_all();
+        }
+    }
+
+public:
+    ThreadPoolEngine(std::function<void(const io_request &)> exec, unsigned threads = 4) : _exec(exec)
+    {
+        for (unsigned i = 0; i < threads; i++)
+            _workers.emplace_back(&ThreadPoolEngine::_worker, this);
+    }
+    ~ThreadPoolEngine()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            _stop = true;
+        }
+        _work_cv.notify_all();
+        for (auto &&t : _workers)
+            t.join();
+    }
+    void submit(const io_request *reqs, size_t n) override
+    {
+        if (n == 0)
+            return;
+        size_t remaining = n;
+        std::unique_lock<std::mutex> lock(_mtx);
+        for (size_t i = 0; i < n; i++)
+            _queue.push_back({reqs + i, &remaining});
+        _work_cv.notify_all();
+        _done_cv.wait(lock, [&]
+                      { return remaining == 0; });
+    }
+    const char *name() const override
+    {
+        return "threadpool";
+    }
+};
+
+#ifdef EXT2M_HAVE_IO_URING
+/**
+ * @brief io_uring engine, talks to the kernel through the raw syscalls so no liburing is needed.
+ * One ring is shared by all callers, a batch owns it until all its requests have completed.
+ */
+class UringEngine : public IOEngine
+{
+private:
+    int _fd;
+    int _ring_fd = -1;
+    unsigned _entries = 0;
+
+    void *_sq_ptr = MAP_FAILED;
+    void *_cq_ptr = MAP_FAILED;
+    size_t _sq_size = 0;
+    size_t _cq_size = 0;
+    io_uring_sqe *_sqes = (io_uring_sqe *)MAP_FAILED;
+    size_t _sqes_size = 0;
+
+    unsigned *_sq_head, *_sq_tail, *_sq_mask, *_sq_array;
+    unsigned *_cq_head, *_cq_tail, *_cq_mask;
+    io_uring_cqe *_cqes;
+
+    std::mutex _mtx;
+
+    static size_t _length(const io_request &r)
+    {
+        if (not r.iov)
+            return BLOCK_SIZE;
+        size_t len = 0;
+        for (int i = 0; i < r.iovcnt; i++)
+            len += r.iov[i].iov_len;
+        return len;
+    }
+
+    void _release()
+    {
+        if (_sqes != MAP_FAILED)
+            munmap(_sqes, _sqes_size);
+        if (_cq_ptr != MAP_FAILED and _cq_ptr != _sq_ptr)
+            munmap(_cq_ptr, _cq_size);
+        if (_sq_ptr != MAP_FAILED)
+            munmap(_sq_ptr, _sq_size);
+        if (_ring_fd >= 0)
+            close(_ring_fd);
+        _sqes = (io_uring_sqe *)MAP_FAILED;
+        _sq_ptr = _cq_ptr = MAP_FAILED;
+        _ring_fd = -1;
+    }
+
+public:
+    UringEngine(int fd, unsigned entries = 64) : _fd(fd)
+    {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        _ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+        if (_ring_fd < 0)
+            return;
+        _entries = p.sq_entries;
+        _sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        _cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+            _sq_size = _cq_size = std::max(_sq_size, _cq_size);
+        _sq_ptr = mmap(nullptr, _sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQ_RING);
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+            _cq_ptr = _sq_ptr;
+        else
+            _cq_ptr = mmap(nullptr, _cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_CQ_RING);
+        _sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+        _sqes = (io_uring_sqe *)mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQES);
+        if (_sq_ptr == MAP_FAILED or _cq_ptr == MAP_FAILED or _sqes == MAP_FAILED)
+        {
+            _release();
+            return;
+        }
+        auto *sq = (uint8_t *)_sq_ptr;
+        _sq_head = (unsigned *)(sq + p.sq_off.head);
+        _sq_tail = (unsigned *)(sq + p.sq_off.tail);
+        _sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+        _sq_array = (unsigned *)(sq + p.sq_off.array);
+        auto *cq = (uint8_t *)_cq_ptr;
+        _cq_head = (unsigned *)(cq + p.cq_off.head);
+        _cq_tail = (unsigned *)(cq + p.cq_off.tail);
+        _cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+        _cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+    }
+    ~UringEngine()
+    {
+        _release();
+    }
+    /**
+     * @brief Whether the kernel accepted the ring.
+     */
+    bool ok() const
+    {
+        return _ring_fd >= 0;
+    }
+    void submit(const io_request *reqs, size_t n) override
+    {
+        if (n == 0)
+            return;
+        std::vector<iovec> iov(n);
+        std::lock_guard<std::mutex> lock(_mtx);
+        size_t queued = 0, completed = 0;
+        while (completed < n)
+        {
+            // Fill the submission queue, keep at most _entries requests in flight.
+            unsigned tail = *_sq_tail;
+            while (queued < n and queued - completed < _entries)
+            {
+                auto &&r = reqs[queued];
+                iov[queued].iov_base = r.buf;
+                iov[queued].iov_len = BLOCK_SIZE;
+                unsigned idx = tail & *_sq_mask;
+                io_uring_sqe *sqe = &_sqes[idx];
+                memset(sqe, 0, sizeof(*sqe));
+                sqe->opcode = r.write ? IORING_OP_WRITEV : IORING_OP_READV;
+                sqe->fd = _fd;
+                sqe->addr = (uint64_t)(r.iov ? r.iov : &iov[queued]);
+                sqe->len = r.iov ? r.iovcnt : 1;
+                sqe->off = (uint64_t)r.block_num * BLOCK_SIZE;
+                sqe->user_data = queued;
+                _sq_array[idx] = idx;
+                tail++;
+                queued++;
+            }
+            __atomic_store_n(_sq_tail, tail, __ATOMIC_RELEASE);
+
+            unsigned to_submit = tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+            auto s = syscall(__NR_io_uring_enter, _ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (s < 0 and errno != EINTR and errno != EAGAIN and errno != EBUSY)
+                assert(0);
+
+            // Reap whatever has completed.
+            unsigned head = *_cq_head;
+            while (head != __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE))
+            {
+                io_uring_cqe *cqe = &_cqes[head & *_cq_mask];
+                assert(cqe->res == (int)_length(reqs[cqe->user_data]));
+                head++;
+                completed++;
+            }
+            __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+        }
+    }
+    const char *name() const override
+    {
+        return "io_uring";
+    }
+};
+#endif
+
+#endif
@@ -0,0 +1,214 @@
+#include <bits/stdc++.h>
+#include "cache.hpp"
+#include "bitmap.hpp"
+
+using namespace std;
+
+// Benchmarks of the ext2s-fs building blocks, run with ./bench [name ...], all of them by default.
+
+static double seconds_since(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * @brief Hot metadata (inode table, bitmaps) interleaved with streaming reads of large files, as `cat` does.
+ * Reports how many metadata reads still hit after each stream.
+ */
+static void bench_cache_policy()
+{
+    const unsigned capacity = 8 * BLOCK_SIZE; // same as the server
+    const unsigned hot_blocks = 2048;         // metadata working set, a quarter of the cache
+    const unsigned stream_blocks = 8192;      // 8 MB file, as large as the cache
+    const unsigned rounds = 6;
+
+    printf("cache_policy: capacity %u blocks, hot set %u blocks, stream %u blocks, %u rounds\n", capacity, hot_blocks, stream_blocks, rounds);
+    printf("%-8s %12s %12s %10s\n", "policy", "hot hit %", "all hit %", "time s");
+
+    Disk disk("bench.img");
+    for (auto policy : {CachePolicy::LRU, CachePolicy::TWO_Q})
+    {
+        Cache cache(disk, capacity, 0, policy);
+        mt19937 rng(42);
+        vector<uint8_t> buf(stream_blocks * BLOCK_SIZE);
+        uint8_t block[BLOCK_SIZE];
+        size_t hot_hits = 0, hot_reads = 0;
+        auto start = chrono::steady_clock::now();
+
+        // The hot blocks are read a few times before the first scan, as after mount.
+        for (unsigned i = 0; i < 4 * hot_blocks; i++)
+            cache.read_block(1 + i % hot_blocks, block);
+        cache.reset_stats();
+
+        for (unsigned r = 0; r < rounds; r++)
+        {
+            unsigned first = 10000 + r * stream_blocks; // a different file every round
+            cache.read_blocks(first, stream_blocks, buf.data());
+
+            auto before = cache.stats();
+            for (unsigned i = 0; i < 4 * hot_blocks; i++)
+                cache.read_block(1 + rng() % hot_blocks, block);
+            auto after = cache.stats();
+            hot_hits += after.hits - before.hits;
+            hot_reads += (after.hits + after.misses) - (before.hits + before.misses);
+        }
+        auto all = cache.stats();
+        printf("%-8s %12.2f %12.2f %10.3f\n", policy == CachePolicy::LRU ? "LRU" : "2Q",
+               100.0 * hot_hits / hot_reads, 100.0 * all.hits / (all.hits + all.misses), seconds_since(start));
+    }
+    remove("bench.img");
+}
+
+/**
+ * @brief The block device backends without the cache in front: random single-block reads and writes, as cache misses and
+ * writebacks do, and sequential batches of 64 blocks, as readahead and coalesced writeback do.
+ */
+static void bench_disk_backend()
+{
+    const unsigned blocks = DISK_SIZE / BLOCK_SIZE;
+    const unsigned ops = 20000;
+    const unsigned batch = 64;
+    const unsigned batches = 1000;
+
+    printf("disk_backend: %u random block reads/writes, %u sequential batches of %u blocks\n", ops, batches, batch);
+    printf("%-8s %-12s %12s %12s %12s %12s %10s\n", "backend", "engine", "rand rd us", "rand wr us", "seq rd MB/s", "seq wr MB/s", "sync ms");
+
+    const pair<const char *, DiskBackend> backends[] = {
+        {"stdio", DiskBackend::STDIO},
+        {"posix", DiskBackend::POSIX},
+        {"mmap", DiskBackend::MMAP},
+    };
+    remove("bench.img");
+    for (auto &&b : backends)
+    {
+        Disk disk("bench.img", b.second);
+        mt19937 rng(42);
+        vector<uint8_t> buf(batch * BLOCK_SIZE, 0x5a);
+        double mb = (double)batches * batch * BLOCK_SIZE / MB;
+
+        auto start = chrono::steady_clock::now();
+        for (unsigned i = 0; i < ops; i++)
+            disk.write_block(rng() % blocks, buf.data());
+        double rand_wr = seconds_since(start) * 1e6 / ops;
+
+        start = chrono::steady_clock::now();
+        disk.sync();
+        double sync_ms = seconds_since(start) * 1e3;
+
+        start = chrono::steady_clock::now();
+        for (unsigned i = 0; i < ops; i++)
+            disk.read_block(rng() % blocks, buf.data());
+        double rand_rd = seconds_since(start) * 1e6 / ops;
+
+        start = chrono::steady_clock::now();
+        for (unsigned i = 0; i < batches; i++)
+            disk.write_blocks(i * batch % (blocks - batch), batch, buf.data());
+        double seq_wr = mb / seconds_since(start);
+
+        start = chrono::steady_clock::now();
+        for (unsigned i = 0; i < batches; i++)
+            disk.read_blocks(i * batch % (blocks - batch), batch, buf.data());
+        double seq_rd = mb / seconds_since(start);
+
+        printf("%-8s %-12s %12.2f %12.2f %12.0f %12.0f %10.1f\n", b.first, disk.engine(), rand_rd, rand_wr, seq_rd, seq_wr, sync_ms);
+    }
+    remove("bench.img");
+}
+
+/**
+ * @brief Finding a free bit in nearly full 8192-bit group bitmaps, as ballocs does, against the bit-at-a-time scan.
+ */
+static void bench_bitmap_scan()
+{
+    const unsigned bits = 8 * BLOCK_SIZE; // one block group
+    const unsigned maps = 64;
+    const unsigned iterations = 20000;
+
+    // Every group is full except a few free blocks somewhere in its last quarter.
+    mt19937 rng(42);
+    vector<unique_ptr<BitMap>> groups;
+    vector<uint8_t> raw(bits / 8, 0xff);
+    for (unsigned i = 0; i < maps; i++)
+    {
+        BitMap bm(raw.data(), bits);
+        for (int j = 0; j < 4; j++)
+            bm.reset(bits - 1 - rng() % (bits / 4));
+        groups.emplace_back(new BitMap(bm.data().first, bits));
+    }
+
+    auto naive_next = [](const BitMap &bm, uint32_t pos) -> uint32_t
+    {
+        for (; pos < bm.size(); pos++)
+            if (!bm.get(pos))
+                return pos;
+        return -1;
+    };
+    auto naive_count = [](const BitMap &bm) -> uint32_t
+    {
+        uint32_t cnt = 0;
+        for (uint32_t pos = 0; pos < bm.size(); pos++)
+            cnt += bm.get(pos);
+        return cnt;
+    };
+
+    const char *simd =
+#if defined(__AVX2__)
+        "avx2";
+#elif defined(__SSE2__)
+        "sse2";
+#else
+        "none";
+#endif
+    printf("bitmap_scan: %u-bit groups with 4 free bits in the last quarter, simd %s\n", bits, simd);
+    printf("%-22s %12s\n", "operation", "ns/op");
+
+    uint64_t sink = 0;
+    auto run = [&](const char *name, function<uint32_t(const BitMap &)> op)
+    {
+        auto start = chrono::steady_clock::now();
+        for (unsigned i = 0; i < iterations; i++)
+            sink += op(*groups[i % maps]);
+        printf("%-22s %12.1f\n", name, seconds_since(start) * 1e9 / iterations);
+    };
+    run("nextBit bit-at-a-time", [&](const BitMap &bm)
+        { return naive_next(bm, 0); });
+    run("nextBit word scan", [&](const BitMap &bm)
+        { return bm.nextBit(0); });
+    run("count bit-at-a-time", [&](const BitMap &bm)
+        { return naive_count(bm); });
+    run("count popcount", [&](const BitMap &bm)
+        { return bm.count(0); });
+    if (sink == 42)
+        printf("\n");
+}
+
+static const map<string, void (*)()> benchmarks = {
+    {"bitmap_scan", bench_bitmap_scan},
+    {"cache_policy", bench_cache_policy},
+    {"disk_backend", bench_disk_backend},
+};
+
+int main(int argc, char **argv)
+{
+    setbuf(stdout, 0);
+    if (argc == 1)
+    {
+        for (auto &&b : benchmarks)
+            b.second();
+        return 0;
+    }
+    for (int i = 1; i < argc; i++)
+    {
+        auto it = benchmarks.find(argv[i]);
+        if (it == benchmarks.end())
+        {
+            printf("Unknown benchmark %s, available:", argv[i]);
+            for (auto &&b : benchmarks)
+                printf(" %s", b.first.c_str());
+            printf("\n");
+            return 1;
+        }
+        it->second();
+    }
+    return 0;
+}
@@ -4,6 +4,9 @@
 #include <cstdint>
 #include <cstring>
 #include <tuple>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 constexpr unsigned BYTEINBITS = 8;
 constexpr uint8_t MSB = 0b10000000; // most significant bit of byte
@@ -20,6 +23,7 @@ private:
     uint8_t *_data;
     unsigned _sizeInBytes;
     unsigned _sizeInBits;
+    bool _owned; // false for a view over someone else's memory
     int _whichByte(int pos) const
     {
         return pos / BYTEINBITS;
@@ -29,6 +33,66 @@ private:
         return MSB >> (pos % BYTEINBITS);
     }
 
+    /**
+     * @brief The i-th 64 bits, bit pos is at (63 - pos % 64) so the first bit is the most significant one.
+     * Bits past the end read as 0.
+     */
+    uint64_t _word(uint32_t i) const
+    {
+        uint64_t w = 0;
+        uint32_t first = i * 8;
+        if (first + 8 <= _sizeInBytes)
+            memcpy(&w, _data + first, 8);
+        else if (first < _sizeInBytes)
+            memcpy(&w, _data + first, _sizeInBytes - first);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        w = __builtin_bswap64(w);
+#endif
+        uint32_t end = (i + 1) * 64;
+        if (end > _sizeInBits)
+            w &= end - _sizeInBits >= 64 ? 0 : ~0ULL << (end - _sizeInBits);
+        return w;
+    }
+
+    /**
+     * @brief Skip the bytes equal to fill, a vector register at a time.
+     * @param pos byte index, multiple of 8
+     * @return a byte index, multiple of 8, whose next 8 bytes are not all fill or are past the end
+     */
+    uint32_t _skip(uint32_t pos, uint8_t fill) const
+    {
+#if defined(__AVX2__)
+        const __m256i f = _mm256_set1_epi8((char)fill);
+        while (pos + 32 <= _sizeInBytes)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(_data + pos));
+            if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, f)) != -1)
+                break;
+            pos += 32;
+        }
+#elif defined(__SSE2__)
+        const __m128i f = _mm_set1_epi8((char)fill);
+        while (pos + 16 <= _sizeInBytes)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(_data + pos));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, f)) != 0xffff)
+                break;
+            pos += 16;
+        }
+#endif
+        uint64_t f64;
+        memset(&f64, fill, 8);
+        while (pos + 8 <= _sizeInBytes)
+        {
+            uint64_t w;
+            memcpy(&w, _data + pos, 8);
+            if (w != f64)
+                break;
+            pos += 8;
+        }
+        return pos;
+    }
+
 public:
     BitMap() = delete;
     BitMap(const BitMap &) = delete;
@@ -37,6 +101,7 @@ public:
         _data = bm._data;
         _sizeInBytes = bm._sizeInBytes;
         _sizeInBits = bm._sizeInBits;
+        _owned = bm._owned;
         bm._data = nullptr;
         bm._sizeInBits = bm._sizeInBytes = 0;
     }
@@ -46,15 +111,33 @@ public:
      * @param data pointer to data
      * @param size length in bits
      */
-    BitMap(const void *data, unsigned size) : _sizeInBits(size)
+    BitMap(const void *data, unsigned size) : _sizeInBits(size), _owned(true)
     {
         _sizeInBytes = (_sizeInBits + BYTEINBITS - 1) / BYTEINBITS;
         _data = new uint8_t[_sizeInBytes];
         memcpy(_data, data, _sizeInBytes);
     }
+    /**
+     * @brief Construct a Bit Map view, reads and writes go straight to data, which must outlive the view.
+     *
+     * @param data pointer to data
+     * @param size length in bits
+     * @param copy true to work on a private copy instead
+     */
+    BitMap(void *data, unsigned size, bool copy) : _sizeInBits(size), _owned(copy)
+    {
+        _sizeInBytes = (_sizeInBits + BYTEINBITS - 1) / BYTEINBITS;
+        if (not copy)
+        {
+            _data = (uint8_t *)data;
+            return;
+        }
+        _data = new uint8_t[_sizeInBytes];
+        memcpy(_data, data, _sizeInBytes);
+    }
     ~BitMap()
     {
-        if (_data)
+        if (_data and _owned)
             delete[] _data;
     }
 
@@ -66,25 +149,79 @@ public:
      */
     uint32_t nextBit(uint32_t pos = 0, bool value = false) const
     {
+        if (pos >= _sizeInBits)
+            return -1;
+        // Search for 1s, looking for a 0 means searching the complement. Runs of bytes that cannot match are skipped.
+        const uint64_t flip = value ? 0 : ~0ULL;
+        uint32_t i = pos / 64;
+        uint64_t w = (_word(i) ^ flip) & (~0ULL >> (pos % 64));
+        while (w == 0)
+        {
+            i = _skip((i + 1) * 8, value ? 0x00 : 0xff) / 8;
+            if (i * 8 >= _sizeInBytes)
+                return -1;
+            w = _word(i) ^ flip;
+        }
+        uint32_t ret = i * 64 + __builtin_clzll(w);
+        return ret < _sizeInBits ? ret : -1;
+    }
+
+    /**
+     * @brief get the first run of n consecutive 0 bits from pos
+     *
+     * @param n run length, at least 1
+     * @param pos start position inclusive
+     * @param best_fit take the shortest run that is long enough instead of the first one
+     * @return start of the run, UINTMAX(-1) if there is none
+     */
+    uint32_t findRun(uint32_t n, uint32_t pos = 0, bool best_fit = false) const
+    {
+        assert(n >= 1);
+        uint32_t best = -1, best_len = -1;
         while (pos < _sizeInBits)
         {
-            if (get(pos) == value)
-                return pos;
-            pos++;
+            // Both ends of each free run are found by word scans.
+            uint32_t start = nextBit(pos, false);
+            if (start == (uint32_t)-1)
+                break;
+            uint32_t end = nextBit(start, true);
+            if (end == (uint32_t)-1)
+                end = _sizeInBits;
+            uint32_t len = end - start;
+            if (len >= n)
+            {
+                if (not best_fit or len == n)
+                    return start;
+                if (len < best_len)
+                {
+                    best = start;
+                    best_len = len;
+                }
+            }
+            pos = end;
         }
-        return -1;
+        return best;
     }
 
+    /**
+     * @brief count the bits equal to value from p to the end
+     */
     uint32_t count(uint32_t p = 0, bool value = true) const
     {
-        uint32_t cnt = 0;
-        while (p < _sizeInBits)
+        if (p >= _sizeInBits)
+            return 0;
+        uint32_t i = p / 64;
+        uint32_t ones = __builtin_popcountll(_word(i) & (~0ULL >> (p % 64)));
+        // Whole words in the middle, the byte order does not matter to popcount.
+        for (i++; (i + 1) * 64 <= _sizeInBits; i++)
         {
-            if (get(p) == value)
-                cnt++;
-            p++;
+            uint64_t w;
+            memcpy(&w, _data + i * 8, 8);
+            ones += __builtin_popcountll(w);
         }
-        return cnt;
+        if (i * 64 < _sizeInBits)
+            ones += __builtin_popcountll(_word(i));
+        return value ? ones : _sizeInBits - p - ones;
     }
 
     // // useless
@@ -126,6 +263,33 @@ public:
         _data[_whichByte(pos)] &= (~_getMask(pos));
     }
 
+    /**
+     * @brief reset n bits from pos, whole bytes at a time.
+     * @return how many of them were set
+     */
+    uint32_t resetRange(unsigned pos, unsigned n)
+    {
+        assert(pos + n <= _sizeInBytes * BYTEINBITS);
+        unsigned end = pos + n;
+        uint32_t ones = 0;
+        for (; pos < end and pos % BYTEINBITS != 0; pos++)
+        {
+            ones += get(pos);
+            reset(pos);
+        }
+        unsigned bytes = (end - pos) / BYTEINBITS;
+        uint8_t *first = _data + _whichByte(pos);
+        for (unsigned i = 0; i < bytes; i++)
+            ones += __builtin_popcount(first[i]);
+        memset(first, 0, bytes);
+        for (pos += bytes * BYTEINBITS; pos < end; pos++)
+        {
+            ones += get(pos);
+            reset(pos);
+        }
+        return ones;
+    }
+
     void resetAll()
     {
         memset(_data, 0, _sizeInBytes);
@@ -6,114 +6,868 @@
 #include <string.h>
 #include <vector>
 #include <queue>
+#include <algorithm>
+#include <mutex>
+#include <map>
+#include <deque>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+class Cache;
+
+/**
+ * @brief A pinned cached block. The slot is not evicted while the handle lives, so its data can be
+ * read and modified in place. Call mark_dirty() after modifying it.
+ */
+class BlockRef
+{
+private:
+    friend class Cache;
+    Cache *_cache = nullptr;
+    void *_shard = nullptr;
+    size_t _pos = 0;
+    uint8_t *_data = nullptr;
+
+    BlockRef(Cache *cache, void *shard, size_t pos, uint8_t *data) : _cache(cache), _shard(shard), _pos(pos), _data(data) {}
+
+public:
+    BlockRef() = default;
+    BlockRef(const BlockRef &) = delete;
+    BlockRef &operator=(const BlockRef &) = delete;
+    BlockRef(BlockRef &&other) noexcept
+    {
+        *this = std::move(other);
+    }
+    BlockRef &operator=(BlockRef &&other) noexcept;
+    ~BlockRef()
+    {
+        release();
+    }
+
+    uint8_t *data() const
+    {
+        return _data;
+    }
+    template <typename T>
+    T *as() const
+    {
+        return (T *)_data;
+    }
+    /**
+     * @brief The block will be written back to the disk.
+     */
+    void mark_dirty();
+    /**
+     * @brief Unpin the block, the handle becomes empty.
+     */
+    void release();
+};
+
+/**
+ * @brief Tuning of the background writeback of Cache.
+ */
+struct writeback_options
+{
+    unsigned interval_ms = 1000; // how often the flusher wakes up
+    unsigned expire_ms = 5000;   // dirty blocks older than this are written back
+    unsigned dirty_ratio = 20;   // percent of the cache dirty at which the flusher starts early and writes everything back
+};
+
+/**
+ * @brief Replacement policy of Cache.
+ * LRU: one recency list, a scan of many blocks pushes everything else out.
+ * TWO_Q: new blocks enter a FIFO (A1in) and only move to the LRU list (Am) when they are referenced again
+ * after leaving it, remembered by a list of recently evicted block numbers (A1out). Blocks read once, like a large
+ * file being streamed, leave through the FIFO while the hot metadata stays in Am.
+ */
+enum class CachePolicy
+{
+    LRU,
+    TWO_Q
+};
+
+/**
+ * @brief Demand lookups of Cache, prefetches are not counted.
+ */
+struct cache_stats
+{
+    size_t hits = 0;
+    size_t misses = 0;
+};
+
 // LRU CACHE FOR DISK
+// The slots are split into shards, each with its own LRU list and mutex, so threads working on different blocks do not contend.
 class Cache
 {
 private:
+    friend class BlockRef;
     Disk &_disk;
     const unsigned _capacity; // LRU CACHE CAPACITY
+    const bool _mapped;       // the disk is memory-mapped, the page cache is the block cache
+    const CachePolicy _policy;
+
+    // Runs of SHARD_STRIDE adjacent blocks map to the same shard, so they can still be read and written together.
+    static constexpr unsigned SHARD_STRIDE = 32;
 
     struct cache_item
     {
         uint8_t data[BLOCK_SIZE];
         size_t block_idx;
         bool dirty;
+        std::chrono::steady_clock::time_point dirtied_at; // when the block went from clean to dirty
+        unsigned long dirty_seq; // bumped on every modification, tells a writeback whether the block changed meanwhile
+        unsigned pins; // number of BlockRef on the slot, a pinned slot is never evicted
+        bool in_a1;    // TWO_Q: the slot is in the A1in FIFO, not in the LRU list
         cache_item()
         {
             memset(data, 0, BLOCK_SIZE);
             block_idx = (size_t)-1;
             dirty = false;
+            dirty_seq = 0;
+            pins = 0;
+            in_a1 = false;
         }
     };
-    void _write_item_back(cache_item &item)
+    std::vector<cache_item> _cache;
+
+    using lru_iterator = std::list<size_t>::iterator;
+    struct shard
+    {
+        std::mutex mtx;
+        unsigned capacity;
+        unsigned evict_batch; // number of slots freed at once, their dirty blocks are written back in one batch
+        std::queue<size_t> free_postion;
+        std::list<size_t /*position in _cache*/> lru_list; // Most Recently Used List , the back one is LRU. Am of TWO_Q.
+        std::unordered_map<size_t /*block_index*/, lru_iterator> lru_map; // every cached block, in lru_list or a1in
+        // TWO_Q only
+        unsigned a1in_max;                                // A1in size above which it is evicted before Am
+        unsigned a1out_max;                               // number of remembered evicted blocks
+        std::list<size_t /*position in _cache*/> a1in;    // FIFO of blocks referenced once, the back one is the oldest
+        std::list<size_t /*block_index*/> a1out;          // blocks evicted from A1in, the back one is the oldest
+        std::unordered_map<size_t /*block_index*/, std::list<size_t>::iterator> a1out_map;
+        cache_stats stats;
+        std::map<size_t /*block_index*/, size_t /*position in _cache*/> dirty; // in disk order, so a sync walks only these
+    };
+    unsigned _shard_count = 0;
+    std::unique_ptr<shard[]> _shards;
+
+    std::atomic<size_t> _dirty_total{0};
+
+    // Background writeback
+    writeback_options _wb_opts;
+    std::thread _wb_thread;
+    std::mutex _wb_mtx; // serializes writeback rounds, so two writes of one block are never in flight together
+    std::mutex _wb_wake_mtx;
+    std::condition_variable _wb_cv;
+    bool _wb_stop = false;
+    bool _wb_kick = false;
+    size_t _wb_threshold = 0; // dirty blocks that wake the flusher, 0 when it is not running
+    std::function<void()> _wb_sync; // full file system sync run by the flusher, see start_writeback()
+
+    // Asynchronous readahead
+    static constexpr size_t READAHEAD_QUEUE_MAX = 64; // pending requests, more are dropped
+    std::thread _ra_thread;
+    std::mutex _ra_mtx;
+    std::condition_variable _ra_cv;
+    std::deque<std::vector<uint32_t>> _ra_queue;
+    bool _ra_stop = false;
+
+    shard &_shard_of(size_t block_idx)
+    {
+        return _shards[(block_idx / SHARD_STRIDE) % _shard_count];
+    }
+
+    void _mark_dirty(shard &sh, size_t pos)
+    {
+        cache_item &item = _cache[pos];
+        item.dirty_seq++;
+        if (item.dirty)
+            return;
+        item.dirty = true;
+        item.dirtied_at = std::chrono::steady_clock::now();
+        sh.dirty.emplace(item.block_idx, pos);
+        auto n = ++_dirty_total;
+        if (n == _wb_threshold)
+        {
+            std::lock_guard<std::mutex> lock(_wb_wake_mtx);
+            _wb_kick = true;
+            _wb_cv.notify_one();
+        }
+    }
+
+    void _write_item_back(shard &sh, cache_item &item)
     {
         if (item.dirty and item.block_idx != (size_t)-1)
         {
             _disk.write_block(item.block_idx, item.data);
             item.dirty = false;
+            sh.dirty.erase(item.block_idx);
+            _dirty_total--;
         }
     }
-    std::vector<cache_item> _cache;
-    std::queue<size_t> _free_postion;
 
-    std::list<size_t /*position in _cache*/> _lru_list; // Most Recently Used List , the back one is LRU.
-    std::unordered_map<size_t /*block_index*/, decltype(_lru_list.begin())> _lru_map;
+    void _update(shard &sh, lru_iterator &it)
+    {
+        // TWO_Q: a block in A1in keeps its place, repeated references right after the first one do not make it hot.
+        if (_cache[*it].in_a1)
+            return;
+        sh.lru_list.splice(sh.lru_list.begin(), sh.lru_list, it);
+    }
 
-    void _update(decltype(_lru_list.begin()) &it)
+    /**
+     * @brief Append up to max unpinned slots from the back of the list to victims.
+     */
+    void _pick_victims(std::list<size_t> &list, size_t max, std::vector<size_t> &victims)
     {
-        auto pos = *it;
-        _lru_list.erase(it);
-        _lru_list.push_front(pos);
-        _lru_map[_cache[pos].block_idx] = _lru_list.begin();
+        size_t n = 0;
+        for (auto it = list.rbegin(); it != list.rend() and n < max; ++it)
+        {
+            if (_cache[*it].pins != 0)
+                continue;
+            victims.push_back(*it);
+            n++;
+        }
     }
 
-    ssize_t _get_avaiable_pos()
+    void _remember_evicted(shard &sh, size_t block_idx)
     {
-        if (_free_postion.empty())
+        sh.a1out.push_front(block_idx);
+        sh.a1out_map[block_idx] = sh.a1out.begin();
+        if (sh.a1out.size() > sh.a1out_max)
+        {
+            sh.a1out_map.erase(sh.a1out.back());
+            sh.a1out.pop_back();
+        }
+    }
+
+    ssize_t _get_avaiable_pos(shard &sh)
+    {
+        if (sh.free_postion.empty())
             return -1;
-        ssize_t pos = _free_postion.front();
-        _free_postion.pop();
+        ssize_t pos = sh.free_postion.front();
+        sh.free_postion.pop();
         return pos;
     }
 
-    void _free_lru()
+    /**
+     * @brief Transfer blocks in disk order. Runs of adjacent blocks become one vectored request,
+     * and all requests are in flight at once.
+     *
+     * @param write
+     * @param blocks block index and its BLOCK_SIZE buffer
+     */
+    void _rw_blocks(bool write, std::vector<std::pair<size_t, uint8_t *>> &blocks)
     {
-        assert(!_lru_list.empty());
-        auto pos = _lru_list.back();
-        cache_item &item = _cache[pos];
-        _lru_list.pop_back();
-        _lru_map.erase(item.block_idx);
-        _write_item_back(item);
-        item.block_idx = -1;
-        _free_postion.push(pos);
+        std::sort(blocks.begin(), blocks.end());
+        std::vector<iovec> iov;
+        std::vector<io_request> reqs;
+        iov.reserve(blocks.size());
+        for (size_t i = 0; i < blocks.size(); i++)
+        {
+            iov.push_back({blocks[i].second, BLOCK_SIZE});
+            if (i == 0 or blocks[i].first != blocks[i - 1].first + 1 or reqs.back().iovcnt == IOV_MAX)
+            {
+                io_request r = {write, (unsigned)blocks[i].first, nullptr};
+                reqs.push_back(r);
+            }
+            reqs.back().iovcnt++;
+        }
+        size_t first = 0;
+        for (auto &&r : reqs)
+        {
+            r.iov = &iov[first];
+            first += r.iovcnt;
+        }
+        _disk.submit(reqs.data(), reqs.size());
+    }
+
+    /**
+     * @brief Transfer the slots' blocks in place, see _rw_blocks().
+     *
+     * @param write
+     * @param slots positions in _cache
+     */
+    void _rw_slots(bool write, const std::vector<size_t> &slots)
+    {
+        std::vector<std::pair<size_t, uint8_t *>> blocks;
+        blocks.reserve(slots.size());
+        for (auto &&pos : slots)
+            blocks.emplace_back(_cache[pos].block_idx, _cache[pos].data);
+        _rw_blocks(write, blocks);
+    }
+
+    /**
+     * @brief Write the dirty slots back and drop them from their shards' dirty sets. Their shards must be locked.
+     */
+    void _write_back(std::vector<size_t> &slots)
+    {
+        _rw_slots(true, slots);
+        for (auto &&pos : slots)
+        {
+            cache_item &item = _cache[pos];
+            item.dirty = false;
+            _shard_of(item.block_idx).dirty.erase(item.block_idx);
+        }
+        _dirty_total -= slots.size();
+    }
+
+    /**
+     * @brief One writeback round. The chosen blocks are pinned and copied under their shard lock,
+     * then the copies are written with no shard locked, so sessions keep using the cache meanwhile.
+     * A block is marked clean only once its copy is on the disk and it was not modified since the copy,
+     * otherwise it stays dirty for the next round.
+     *
+     * @param expired_only only blocks dirty for longer than expire_ms
+     * @return number of blocks written
+     */
+    size_t _writeback_round(bool expired_only)
+    {
+        std::lock_guard<std::mutex> wb_lock(_wb_mtx);
+        auto deadline = std::chrono::steady_clock::now() - std::chrono::milliseconds(_wb_opts.expire_ms);
+        std::vector<size_t> slots;
+        std::vector<unsigned long> seqs;
+        std::vector<uint8_t> copies;
+        for (unsigned i = 0; i < _shard_count; i++)
+        {
+            auto &&sh = _shards[i];
+            std::lock_guard<std::mutex> lock(sh.mtx);
+            // Leave half of the shard unpinned for eviction.
+            size_t limit = slots.size() + sh.capacity / 2;
+            for (auto it = sh.dirty.begin(); it != sh.dirty.end() and slots.size() < limit; ++it)
+            {
+                cache_item &item = _cache[it->second];
+                if (expired_only and item.dirtied_at > deadline)
+                    continue;
+                item.pins++;
+                slots.push_back(it->second);
+                seqs.push_back(item.dirty_seq);
+                copies.insert(copies.end(), item.data, item.data + BLOCK_SIZE);
+            }
+        }
+        if (slots.empty())
+            return 0;
+        std::vector<std::pair<size_t, uint8_t *>> blocks;
+        blocks.reserve(slots.size());
+        for (size_t i = 0; i < slots.size(); i++)
+            blocks.emplace_back(_cache[slots[i]].block_idx, &copies[i * BLOCK_SIZE]);
+        _rw_blocks(true, blocks);
+        for (size_t i = 0; i < slots.size(); i++)
+        {
+            cache_item &item = _cache[slots[i]];
+            auto &&sh = _shard_of(item.block_idx);
+            std::lock_guard<std::mutex> lock(sh.mtx);
+            item.pins--;
+            if (item.dirty and item.dirty_seq == seqs[i])
+            {
+                item.dirty = false;
+                sh.dirty.erase(item.block_idx);
+                _dirty_total--;
+            }
+        }
+        return slots.size();
+    }
+
+    void _readahead_worker()
+    {
+        std::unique_lock<std::mutex> lock(_ra_mtx);
+        while (true)
+        {
+            _ra_cv.wait(lock, [this]
+                        { return _ra_stop or !_ra_queue.empty(); });
+            if (_ra_stop)
+                return;
+            auto blocks = std::move(_ra_queue.front());
+            _ra_queue.pop_front();
+            lock.unlock();
+            _prefetch(blocks.data(), blocks.size(), false);
+            lock.lock();
+        }
+    }
+
+    void _writeback_worker()
+    {
+        auto last_sync = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(_wb_wake_mtx);
+        while (not _wb_stop)
+        {
+            _wb_cv.wait_for(lock, std::chrono::milliseconds(_wb_opts.interval_ms), [this]
+                            { return _wb_stop or _wb_kick; });
+            if (_wb_stop)
+                break;
+            bool kicked = _wb_kick;
+            _wb_kick = false;
+            lock.unlock();
+            auto now = std::chrono::steady_clock::now();
+            if (_wb_sync and (kicked or now - last_sync >= std::chrono::milliseconds(_wb_opts.expire_ms)))
+            {
+                // The metadata kept outside the cache reaches the disk together with the blocks.
+                _wb_sync();
+                last_sync = now;
+            }
+            else if (_mapped)
+                _disk.sync();
+            else if (_writeback_round(not kicked and not over_dirty_ratio()) > 0)
+                _disk.sync();
+            lock.lock();
+        }
     }
 
-    void _get_block_from_disk(size_t block_idx)
+    /**
+     * @brief Free the shard's least recently used unpinned slots, writing back the dirty ones as one batch.
+     */
+    void _free_lru(shard &sh)
     {
-        assert(_lru_map.count(block_idx) == 0);
-        if (_free_postion.empty())
-            _free_lru();
-        ssize_t pos = _get_avaiable_pos();
+        assert(!sh.lru_map.empty());
+        std::vector<size_t> victims;
+        std::vector<size_t> dirty;
+        // TWO_Q: while A1in is over its size the whole batch leaves from it, Am is only touched once A1in is back
+        // within bounds, so a stream never pushes out hot blocks.
+        if (sh.a1in.size() > sh.a1in_max)
+            _pick_victims(sh.a1in, sh.evict_batch, victims);
+        if (victims.empty())
+            _pick_victims(sh.lru_list, sh.evict_batch, victims);
+        if (victims.empty())
+            _pick_victims(sh.a1in, sh.evict_batch, victims);
+        assert(!victims.empty()); // every slot of the shard is pinned
+        for (auto &&pos : victims)
+        {
+            if (_cache[pos].dirty)
+                dirty.push_back(pos);
+        }
+        _write_back(dirty);
+        for (auto &&pos : victims)
+        {
+            cache_item &item = _cache[pos];
+            auto it = sh.lru_map.find(item.block_idx);
+            if (item.in_a1)
+            {
+                sh.a1in.erase(it->second);
+                _remember_evicted(sh, item.block_idx);
+            }
+            else
+                sh.lru_list.erase(it->second);
+            sh.lru_map.erase(it);
+            item.in_a1 = false;
+            item.dirty = false;
+            item.block_idx = -1;
+            sh.free_postion.push(pos);
+        }
+    }
+
+    /**
+     * @brief Take a free slot of the shard for the block, without reading it.
+     * @return position in _cache
+     */
+    size_t _claim(shard &sh, size_t block_idx)
+    {
+        assert(sh.lru_map.count(block_idx) == 0);
+        if (sh.free_postion.empty())
+            _free_lru(sh);
+        ssize_t pos = _get_avaiable_pos(sh);
         assert(pos != -1);
         cache_item &item = _cache[pos];
         assert(item.block_idx == (size_t)-1);
         item.block_idx = block_idx;
         item.dirty = false;
-        _disk.read_block(block_idx, item.data);
-        _lru_list.push_front(pos);
-        _lru_map[block_idx] = _lru_list.begin();
+        auto ghost = sh.a1out_map.find(block_idx);
+        if (_policy == CachePolicy::TWO_Q and ghost == sh.a1out_map.end())
+        {
+            item.in_a1 = true;
+            sh.a1in.push_front(pos);
+            sh.lru_map[block_idx] = sh.a1in.begin();
+            return pos;
+        }
+        if (ghost != sh.a1out_map.end())
+        {
+            // Referenced again soon after leaving A1in: it is hot.
+            sh.a1out.erase(ghost->second);
+            sh.a1out_map.erase(ghost);
+        }
+        sh.lru_list.push_front(pos);
+        sh.lru_map[block_idx] = sh.lru_list.begin();
+        return pos;
+    }
+
+    /**
+     * @brief Load the uncached blocks of one shard with one batch of reads. Runs of adjacent blocks are read by one preadv.
+     *
+     * @param blocks all in shard sh
+     * @param n at most half of the shard's capacity
+     * @param demand the blocks are about to be read, count them in the stats
+     */
+    void _load(shard &sh, const uint32_t *blocks, size_t n, bool demand)
+    {
+        std::vector<size_t> slots;
+        for (size_t i = 0; i < n; i++)
+        {
+            assert(blocks[i] < DISK_SIZE / BLOCK_SIZE);
+            if (sh.lru_map.count(blocks[i]) == 0)
+                slots.push_back(_claim(sh, blocks[i]));
+            else if (demand)
+                sh.stats.hits++;
+        }
+        if (demand)
+            sh.stats.misses += slots.size();
+        _rw_slots(false, slots);
+    }
+
+    /**
+     * @brief Find the block's slot, reading it from the disk on a miss. The shard must be locked.
+     * @param count_hit false if the block was already counted by _load
+     * @return position in _cache
+     */
+    size_t _lookup(shard &sh, size_t block_idx, bool count_hit = true)
+    {
+        auto it = sh.lru_map.find(block_idx);
+        if (it == sh.lru_map.end())
+        {
+            sh.stats.misses++;
+            auto pos = _claim(sh, block_idx);
+            _disk.read_block(block_idx, _cache[pos].data);
+            return pos;
+        }
+        if (count_hit)
+            sh.stats.hits++;
+        auto pos = *(it->second);
+        _update(sh, it->second);
+        return pos;
+    }
+
+    /**
+     * @brief Load blocks grouped per shard, see prefetch().
+     */
+    void _prefetch(const uint32_t *blocks, size_t n, bool demand)
+    {
+        if (_mapped)
+            return;
+        std::vector<std::vector<uint32_t>> per_shard(_shard_count);
+        for (size_t i = 0; i < n; i++)
+        {
+            auto &&v = per_shard[(blocks[i] / SHARD_STRIDE) % _shard_count];
+            v.push_back(blocks[i]);
+        }
+        for (unsigned i = 0; i < _shard_count; i++)
+        {
+            if (per_shard[i].empty())
+                continue;
+            auto &&sh = _shards[i];
+            std::lock_guard<std::mutex> lock(sh.mtx);
+            _load(sh, per_shard[i].data(), std::min<size_t>(per_shard[i].size(), sh.capacity / 2), demand);
+        }
+    }
+
+    void _read(unsigned block_index, void *buf, bool count_hit)
+    {
+        if (_mapped)
+        {
+            memcpy(buf, _disk.block_ptr(block_index), BLOCK_SIZE);
+            return;
+        }
+        auto &&sh = _shard_of(block_index);
+        std::lock_guard<std::mutex> lock(sh.mtx);
+        auto pos = _lookup(sh, block_index, count_hit);
+        memcpy(buf, _cache[pos].data, BLOCK_SIZE);
     }
 
 public:
-    Cache(Disk &disk, unsigned capacity = 1024) : _disk(disk), _capacity(capacity)
+    /**
+     * @brief Construct a new Cache object
+     *
+     * @param disk
+     * @param capacity number of cached blocks
+     * @param shards number of independently locked shards, 0 to pick one from the capacity
+     * @param policy replacement policy
+     */
+    Cache(Disk &disk, unsigned capacity = 1024, unsigned shards = 0, CachePolicy policy = CachePolicy::LRU)
+        : _disk(disk), _capacity(capacity), _mapped(disk.mapped()), _policy(policy)
     {
+        if (_mapped)
+            return;
+        if (shards == 0)
+            shards = std::max(1u, std::min(16u, capacity / 64));
+        assert(capacity >= shards);
+        _shard_count = shards;
+        _shards.reset(new shard[shards]);
         _cache.resize(capacity);
         for (size_t i = 0; i < capacity; i++)
         {
-            _free_postion.push(i);
+            _shards[i % shards].free_postion.push(i);
+        }
+        for (unsigned i = 0; i < shards; i++)
+        {
+            auto &&sh = _shards[i];
+            sh.capacity = sh.free_postion.size();
+            sh.evict_batch = std::max(1u, std::min(32u, sh.capacity / 8));
+            // 2Q paper's tuning: A1in holds a quarter of the cache, A1out remembers half of its size in blocks.
+            sh.a1in_max = _policy == CachePolicy::TWO_Q ? std::max(1u, sh.capacity / 4) : 0;
+            sh.a1out_max = sh.capacity / 2;
         }
+        _ra_thread = std::thread(&Cache::_readahead_worker, this);
     };
     ~Cache()
     {
+        if (_ra_thread.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(_ra_mtx);
+                _ra_stop = true;
+            }
+            _ra_cv.notify_one();
+            _ra_thread.join();
+        }
+        stop_writeback();
         flush_all();
     }
+
+    /**
+     * @brief Start the background flusher. It writes back blocks dirty for longer than expire_ms every interval_ms,
+     * and everything as soon as dirty_ratio percent of the cache is dirty.
+     *
+     * @param opts
+     * @param sync_fs if set, run instead of a round every expire_ms and when dirty_ratio is reached. It must write the
+     * file system's in-memory metadata (inodes, free counters) into the cache and call flush_all(), so the disk never
+     * holds bitmaps newer than the rest. Stop the flusher before destroying what it uses.
+     */
+    void start_writeback(const writeback_options &opts = writeback_options(), std::function<void()> sync_fs = nullptr)
+    {
+        assert(not _wb_thread.joinable());
+        assert(opts.dirty_ratio > 0 and opts.dirty_ratio <= 100);
+        _wb_opts = opts;
+        _wb_stop = false;
+        _wb_threshold = std::max<size_t>(1, ((size_t)_capacity * opts.dirty_ratio + 99) / 100);
+        _wb_sync = std::move(sync_fs);
+        _wb_thread = std::thread(&Cache::_writeback_worker, this);
+    }
+
+    void stop_writeback()
+    {
+        if (not _wb_thread.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(_wb_wake_mtx);
+            _wb_stop = true;
+        }
+        _wb_cv.notify_one();
+        _wb_thread.join();
+        _wb_threshold = 0;
+        _wb_sync = nullptr;
+    }
+
+    bool over_dirty_ratio() const
+    {
+        return _wb_threshold != 0 and _dirty_total >= _wb_threshold;
+    }
     void flushb(unsigned block_index)
     {
-        auto it = _lru_map.find(block_index);
-        assert(it != _lru_map.end());
+        if (_mapped)
+            return;
+        // A writeback round in flight could otherwise land an older copy of the block after this write.
+        std::lock_guard<std::mutex> wb_lock(_wb_mtx);
+        auto &&sh = _shard_of(block_index);
+        std::lock_guard<std::mutex> lock(sh.mtx);
+        auto it = sh.lru_map.find(block_index);
+        assert(it != sh.lru_map.end());
         auto pos = *(it->second);
-        _write_item_back(_cache[pos]);
+        _write_item_back(sh, _cache[pos]);
     }
 
+    /**
+     * @brief Write every dirty block back, in batches sorted by block index so adjacent blocks of different shards still coalesce.
+     */
     void flush_all()
     {
-        for (auto &&item : _cache)
+        if (not _mapped)
         {
-            _write_item_back(item);
+            while (_writeback_round(false) > 0)
+                ;
         }
         _disk.sync();
     }
 
+    /**
+     * @brief Number of dirty blocks waiting for write back.
+     */
+    size_t dirty_count() const
+    {
+        return _dirty_total;
+    }
+
+    cache_stats stats()
+    {
+        cache_stats ret;
+        for (unsigned i = 0; i < _shard_count; i++)
+        {
+            std::lock_guard<std::mutex> lock(_shards[i].mtx);
+            ret.hits += _shards[i].stats.hits;
+            ret.misses += _shards[i].stats.misses;
+        }
+        return ret;
+    }
+
+    void reset_stats()
+    {
+        for (unsigned i = 0; i < _shard_count; i++)
+        {
+            std::lock_guard<std::mutex> lock(_shards[i].mtx);
+            _shards[i].stats = cache_stats();
+        }
+    }
+
+    /**
+     * @brief Load blocks into the cache with one batch of reads per shard, so that they are all in flight at once.
+     * Blocks already cached are skipped. Only a hint: at most half of each shard is filled per call.
+     *
+     * @param blocks block indexes
+     * @param n
+     */
+    void prefetch(const uint32_t *blocks, size_t n)
+    {
+        _prefetch(blocks, n, false);
+    }
+
+    /**
+     * @brief Load the blocks in the background, the caller does not wait.
+     * Only a hint: dropped when too many requests are pending.
+     *
+     * @param blocks block indexes
+     */
+    void readahead(std::vector<uint32_t> blocks)
+    {
+        if (blocks.empty())
+            return;
+        if (_mapped)
+        {
+            // Runs of adjacent blocks
+            size_t first = 0;
+            for (size_t i = 1; i <= blocks.size(); i++)
+            {
+                if (i == blocks.size() or blocks[i] != blocks[i - 1] + 1)
+                {
+                    _disk.willneed(blocks[first], i - first);
+                    first = i;
+                }
+            }
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(_ra_mtx);
+            if (_ra_queue.size() >= READAHEAD_QUEUE_MAX)
+                return;
+            _ra_queue.push_back(std::move(blocks));
+        }
+        _ra_cv.notify_one();
+    }
+
+    /**
+     * @brief Read a list of blocks. Uncached blocks that are physically adjacent are read with one request.
+     *
+     * @param blocks block indexes
+     * @param n
+     * @param buf n * BLOCK_SIZE bytes, blocks[i] goes to buf + i * BLOCK_SIZE
+     */
+    void readv_blocks(const uint32_t *blocks, size_t n, void *buf)
+    {
+        size_t chunk = std::max(1u, _capacity / 2);
+        for (size_t i = 0; i < n; i += chunk)
+        {
+            auto cnt = std::min(chunk, n - i);
+            _prefetch(blocks + i, cnt, true);
+            for (size_t j = i; j < i + cnt; j++)
+                _read(blocks[j], (uint8_t *)buf + j * BLOCK_SIZE, false);
+        }
+    }
+
+    /**
+     * @brief Read n consecutive blocks.
+     *
+     * @param start first block
+     * @param n
+     * @param buf n * BLOCK_SIZE bytes
+     */
+    void read_blocks(unsigned start, size_t n, void *buf)
+    {
+        std::vector<uint32_t> blocks(n);
+        for (size_t i = 0; i < n; i++)
+            blocks[i] = start + i;
+        readv_blocks(blocks.data(), n, buf);
+    }
+
+    /**
+     * @brief Overwrite a list of whole blocks. Uncached blocks are not read first,
+     * the dirty blocks reach the disk later as coalesced writes.
+     *
+     * @param blocks block indexes
+     * @param n
+     * @param buf n * BLOCK_SIZE bytes, buf + i * BLOCK_SIZE goes to blocks[i]
+     */
+    void writev_blocks(const uint32_t *blocks, size_t n, const void *buf)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            auto src = (const uint8_t *)buf + i * BLOCK_SIZE;
+            assert(blocks[i] < DISK_SIZE / BLOCK_SIZE);
+            if (_mapped)
+            {
+                memcpy(_disk.block_ptr(blocks[i]), src, BLOCK_SIZE);
+                continue;
+            }
+            auto &&sh = _shard_of(blocks[i]);
+            std::lock_guard<std::mutex> lock(sh.mtx);
+            auto it = sh.lru_map.find(blocks[i]);
+            size_t pos;
+            if (it == sh.lru_map.end())
+                pos = _claim(sh, blocks[i]);
+            else
+            {
+                pos = *(it->second);
+                _update(sh, it->second);
+            }
+            memcpy(_cache[pos].data, src, BLOCK_SIZE);
+            _mark_dirty(sh, pos);
+        }
+    }
+
+    /**
+     * @brief Overwrite n consecutive blocks.
+     *
+     * @param start first block
+     * @param n
+     * @param buf n * BLOCK_SIZE bytes
+     */
+    void write_blocks(unsigned start, size_t n, const void *buf)
+    {
+        std::vector<uint32_t> blocks(n);
+        for (size_t i = 0; i < n; i++)
+            blocks[i] = start + i;
+        writev_blocks(blocks.data(), n, buf);
+    }
+
+    /**
+     * @brief Pin a block in the cache.
+     *
+     * @param block_index
+     * @param read false if the caller overwrites the whole block, a miss then does not read the disk
+     * @return BlockRef valid until it is destroyed or released
+     */
+    BlockRef get(unsigned block_index, bool read = true)
+    {
+        assert(block_index < DISK_SIZE / BLOCK_SIZE);
+        if (_mapped)
+            return BlockRef(this, nullptr, 0, (uint8_t *)_disk.block_ptr(block_index));
+        auto &&sh = _shard_of(block_index);
+        std::lock_guard<std::mutex> lock(sh.mtx);
+        size_t pos;
+        auto it = sh.lru_map.find(block_index);
+        if (it == sh.lru_map.end() and not read)
+            pos = _claim(sh, block_index);
+        else
+            pos = _lookup(sh, block_index);
+        _cache[pos].pins++;
+        return BlockRef(this, &sh, pos, _cache[pos].data);
+    }
+
     void read_block(unsigned block_index, void *buf)
     {
         // _disk.read_block(block_index, buf);
@@ -121,13 +875,7 @@ public:
 
         assert(block_index < DISK_SIZE / BLOCK_SIZE);
         assert(buf != nullptr);
-        if (_lru_map.count(block_index) == 0)
-            _get_block_from_disk(block_index);
-        auto it = _lru_map.find(block_index);
-        assert(it != _lru_map.end());
-        auto pos = *(it->second);
-        memcpy(buf, _cache[pos].data, BLOCK_SIZE);
-        _update(it->second);
+        _read(block_index, buf, true);
     }
     void write_block(unsigned block_index, const void *buf)
     {
@@ -136,14 +884,46 @@ public:
 
         assert(block_index < DISK_SIZE / BLOCK_SIZE);
         assert(buf != nullptr);
-        if (_lru_map.count(block_index) == 0)
-            _get_block_from_disk(block_index);
-        auto it = _lru_map.find(block_index);
-        assert(it != _lru_map.end());
-        auto pos = *(it->second);
-        memcpy(_cache[pos].data, buf, BLOCK_SIZE);
-        _cache[pos].dirty = true;
-        _update(it->second);
+        writev_blocks(&block_index, 1, buf);
     }
 };
-#endif // __CACHE_H__
\ No newline at end of file
+
+inline BlockRef &BlockRef::operator=(BlockRef &&other) noexcept
+{
+    if (this != &other)
+    {
+        release();
+        _cache = other._cache;
+        _shard = other._shard;
+        _pos = other._pos;
+        _data = other._data;
+        other._cache = nullptr;
+        other._shard = nullptr;
+        other._data = nullptr;
+    }
+    return *this;
+}
+
+inline void BlockRef::mark_dirty()
+{
+    if (_shard == nullptr) // empty, or the block lives in the disk mapping
+        return;
+    auto &&sh = *(Cache::shard *)_shard;
+    std::lock_guard<std::mutex> lock(sh.mtx);
+    _cache->_mark_dirty(sh, _pos);
+}
+
+inline void BlockRef::release()
+{
+    if (_shard != nullptr)
+    {
+        auto &&sh = *(Cache::shard *)_shard;
+        std::lock_guard<std::mutex> lock(sh.mtx);
+        assert(_cache->_cache[_pos].pins > 0);
+        _cache->_cache[_pos].pins--;
+    }
+    _cache = nullptr;
+    _shard = nullptr;
+    _data = nullptr;
+}
+#endif // __CACHE_H__
@@ -17,4 +17,26 @@
 constexpr auto DISK_SIZE = 64 * MB + 3 * KB;
 constexpr auto BLOCK_SIZE = 1 * KB;
 
+// Sequential readahead window in blocks, it starts at READAHEAD_INIT and doubles up to READAHEAD_MAX.
+constexpr unsigned READAHEAD_INIT = 4;
+constexpr unsigned READAHEAD_MAX = 128;
+
+// Blocks reserved ahead for a file being written, the window starts at RESERVE_WINDOW_INIT and doubles up to RESERVE_WINDOW_MAX.
+constexpr unsigned RESERVE_WINDOW_INIT = 8;
+constexpr unsigned RESERVE_WINDOW_MAX = 64;
+
+// Inodes kept in memory by Ext2m, more are kept while that many files are open.
+constexpr unsigned ICACHE_SIZE = 1024;
+
+// A read updates the access time of a file only if it is not after the last change, or older than this many seconds (relatime).
+constexpr unsigned RELATIME_INTERVAL = 24 * 60 * 60;
+
+// Format new images with EXT4_FEATURE_INCOMPAT_EXTENTS, their files and directories are mapped by extents instead of indirect blocks.
+// Default of Ext2m::format_options, the server turns it on with -x.
+constexpr bool FORMAT_EXTENTS = false;
+
+// Format new images with EXT2_FEATURE_COMPAT_DIR_INDEX, a directory growing past one block gets a hash index of its entries.
+// Default of Ext2m::format_options, the server turns it on with -d.
+constexpr bool FORMAT_DIR_INDEX = false;
+
 #endif
\ No newline at end of file
@@ -4,18 +4,99 @@
 #include <error.h>
 #include <assert.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "ext2_spec.h"
 #include "config.hpp"
+#include "aio.hpp"
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
+#include <climits>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <algorithm>
 
-class Disk
+/**
+ * @brief Abstract block device. Read or Write with block size = 1024Byte.
+ * Implementations must be safe to call from multiple threads at once.
+ */
+class BlockDevice
+{
+public:
+    virtual ~BlockDevice() {}
+    virtual void read_block(unsigned block_num, void *buf) = 0;
+    virtual void write_block(unsigned block_num, const void *buf) = 0;
+    virtual void sync() = 0;
+    /**
+     * @brief Read consecutive blocks starting at block_num into the buffers.
+     *
+     * @param block_num first block
+     * @param iov buffers, each iov_len is a multiple of BLOCK_SIZE
+     * @param iovcnt
+     */
+    virtual void readv(unsigned block_num, const iovec *iov, int iovcnt)
+    {
+        for (int i = 0; i < iovcnt; i++)
+        {
+            for (size_t off = 0; off < iov[i].iov_len; off += BLOCK_SIZE)
+                read_block(block_num++, (uint8_t *)iov[i].iov_base + off);
+        }
+    }
+    /**
+     * @brief Write the buffers to consecutive blocks starting at block_num.
+     *
+     * @param block_num first block
+     * @param iov buffers, each iov_len is a multiple of BLOCK_SIZE
+     * @param iovcnt
+     */
+    virtual void writev(unsigned block_num, const iovec *iov, int iovcnt)
+    {
+        for (int i = 0; i < iovcnt; i++)
+        {
+            for (size_t off = 0; off < iov[i].iov_len; off += BLOCK_SIZE)
+                write_block(block_num++, (const uint8_t *)iov[i].iov_base + off);
+        }
+    }
+    /**
+     * @brief Get a pointer to the block's bytes, if the device is addressable in memory.
+     * @return nullptr if the device only supports copying I/O.
+     */
+    virtual uint8_t *block_ptr(unsigned /*block_num*/)
+    {
+        return nullptr;
+    }
+    /**
+     * @brief Hint that n blocks from block_num will be read soon.
+     */
+    virtual void willneed(unsigned /*block_num*/, size_t /*n*/)
+    {
+    }
+    /**
+     * @brief Get the file descriptor usable for positional I/O.
+     * @return -1 if there is none.
+     */
+    virtual int fd()
+    {
+        return -1;
+    }
+};
+
+/**
+ * @brief Block device on top of a stdio FILE*.
+ * Every I/O is a fseek + fread/fwrite pair, so all of them are serialized by one lock.
+ */
+class StdioDevice : public BlockDevice
 {
 private:
     FILE *_fp;
+    std::mutex _mtx;
+    size_t _cnt = 0;
 
 public:
-    Disk(const char *_path)
+    StdioDevice(const char *_path)
     {
         // if file exists, open it, otherwise create it
         _fp = fopen(_path, "r");
@@ -33,40 +114,473 @@ public:
         }
         assert(_fp);
     }
-    ~Disk()
+    ~StdioDevice()
     {
         fclose(_fp);
     }
-    void read_block(unsigned block_num, void *buf)
+    void read_block(unsigned block_num, void *buf) override
     {
-        assert(block_num < DISK_SIZE / BLOCK_SIZE);
-        assert(buf != nullptr);
+        std::lock_guard<std::mutex> lock(_mtx);
         fseek(_fp, block_num * BLOCK_SIZE, SEEK_SET);
         auto s = fread(buf, 1, BLOCK_SIZE, _fp);
         assert(s == BLOCK_SIZE);
     }
-    void write_block(unsigned block_num, const void *buf)
+    void write_block(unsigned block_num, const void *buf) override
     {
-        static size_t cnt = 0;
-        assert(block_num < DISK_SIZE / BLOCK_SIZE);
-        assert(buf != nullptr);
+        std::lock_guard<std::mutex> lock(_mtx);
         fseek(_fp, block_num * BLOCK_SIZE, SEEK_SET);
         auto s = fwrite(buf, 1, BLOCK_SIZE, _fp);
         assert(s == BLOCK_SIZE);
-        if (cnt++ > 4096)
+        if (_cnt++ > 4096)
         {
-            cnt = 0;
+            _cnt = 0;
             // s = fsync(_fd); // ! HUGE DAMAGE TO PERFORMANCE !
             s = fflush(_fp);
             assert(s == 0);
         }
     }
-    void sync()
+    void readv(unsigned block_num, const iovec *iov, int iovcnt) override
     {
+        std::lock_guard<std::mutex> lock(_mtx);
+        fseek(_fp, block_num * BLOCK_SIZE, SEEK_SET);
+        for (int i = 0; i < iovcnt; i++)
+        {
+            auto s = fread(iov[i].iov_base, 1, iov[i].iov_len, _fp);
+            assert(s == iov[i].iov_len);
+        }
+    }
+    void writev(unsigned block_num, const iovec *iov, int iovcnt) override
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        fseek(_fp, block_num * BLOCK_SIZE, SEEK_SET);
+        for (int i = 0; i < iovcnt; i++)
+        {
+            auto s = fwrite(iov[i].iov_base, 1, iov[i].iov_len, _fp);
+            assert(s == iov[i].iov_len);
+        }
+    }
+    void sync() override
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
         // auto s = fsync(_fd);
         auto s = fflush(_fp);
         assert(s == 0);
     }
 };
 
-#endif
\ No newline at end of file
+/**
+ * @brief Block device on top of a raw file descriptor.
+ * Uses positional I/O (pread/pwrite), so there is no shared seek state and no stdio buffering,
+ * and any number of threads can issue I/O at the same time.
+ */
+class PosixDevice : public BlockDevice
+{
+private:
+    int _fd;
+
+    /**
+     * @brief preadv/pwritev the whole vector, resuming after short transfers.
+     */
+    void _rw_vector(bool write, unsigned block_num, const iovec *iov, int iovcnt)
+    {
+        std::vector<iovec> vec(iov, iov + iovcnt);
+        off_t off = (off_t)block_num * BLOCK_SIZE;
+        size_t first = 0;
+        while (first < vec.size())
+        {
+            int cnt = std::min<size_t>(vec.size() - first, IOV_MAX);
+            auto s = write ? pwritev(_fd, &vec[first], cnt, off) : preadv(_fd, &vec[first], cnt, off);
+            if (s == -1 and errno == EINTR)
+                continue;
+            assert(s > 0);
+            off += s;
+            while (s > 0)
+            {
+                if ((size_t)s >= vec[first].iov_len)
+                {
+                    s -= vec[first].iov_len;
+                    first++;
+                }
+                else
+                {
+                    vec[first].iov_base = (uint8_t *)vec[first].iov_base + s;
+                    vec[first].iov_len -= s;
+                    s = 0;
+                }
+            }
+        }
+    }
+
+public:
+    PosixDevice(const char *_path)
+    {
+        // if file exists, open it, otherwise create it
+        _fd = open(_path, O_RDWR | O_CREAT, 0644);
+        assert(_fd != -1);
+        struct stat st;
+        auto s = fstat(_fd, &st);
+        assert(s == 0);
+        if ((size_t)st.st_size <= DISK_SIZE)
+        {
+            s = ftruncate(_fd, DISK_SIZE + 1);
+            assert(s == 0);
+        }
+    }
+    ~PosixDevice()
+    {
+        close(_fd);
+    }
+    void read_block(unsigned block_num, void *buf) override
+    {
+        size_t done = 0;
+        while (done < BLOCK_SIZE)
+        {
+            auto s = pread(_fd, (uint8_t *)buf + done, BLOCK_SIZE - done, (off_t)block_num * BLOCK_SIZE + done);
+            if (s == -1 and errno == EINTR)
+                continue;
+            assert(s > 0);
+            done += s;
+        }
+    }
+    void write_block(unsigned block_num, const void *buf) override
+    {
+        size_t done = 0;
+        while (done < BLOCK_SIZE)
+        {
+            auto s = pwrite(_fd, (const uint8_t *)buf + done, BLOCK_SIZE - done, (off_t)block_num * BLOCK_SIZE + done);
+            if (s == -1 and errno == EINTR)
+                continue;
+            assert(s > 0);
+            done += s;
+        }
+    }
+    void readv(unsigned block_num, const iovec *iov, int iovcnt) override
+    {
+        _rw_vector(false, block_num, iov, iovcnt);
+    }
+    void writev(unsigned block_num, const iovec *iov, int iovcnt) override
+    {
+        _rw_vector(true, block_num, iov, iovcnt);
+    }
+    void sync() override
+    {
+        // Written data is already in the page cache, nothing to flush.
+        // auto s = fsync(_fd); // ! HUGE DAMAGE TO PERFORMANCE !
+    }
+    int fd() override
+    {
+        return _fd;
+    }
+};
+
+/**
+ * @brief Block device on top of a shared memory mapping of the whole image.
+ * Blocks are addressed by pointer, reads and writes are plain memcpy, and the kernel page cache does the writeback.
+ */
+class MmapDevice : public BlockDevice
+{
+private:
+    int _fd;
+    uint8_t *_map;
+
+public:
+    MmapDevice(const char *_path)
+    {
+        // if file exists, open it, otherwise create it
+        _fd = open(_path, O_RDWR | O_CREAT, 0644);
+        assert(_fd != -1);
+        struct stat st;
+        auto s = fstat(_fd, &st);
+        assert(s == 0);
+        if ((size_t)st.st_size <= DISK_SIZE)
+        {
+            s = ftruncate(_fd, DISK_SIZE + 1);
+            assert(s == 0);
+        }
+        _map = (uint8_t *)mmap(nullptr, DISK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+        assert(_map != MAP_FAILED);
+        // The image is small enough to stay resident, fault it in up front.
+        madvise(_map, DISK_SIZE, MADV_WILLNEED);
+    }
+    ~MmapDevice()
+    {
+        msync(_map, DISK_SIZE, MS_SYNC);
+        munmap(_map, DISK_SIZE);
+        close(_fd);
+    }
+    void read_block(unsigned block_num, void *buf) override
+    {
+        memcpy(buf, _map + (size_t)block_num * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    void write_block(unsigned block_num, const void *buf) override
+    {
+        memcpy(_map + (size_t)block_num * BLOCK_SIZE, buf, BLOCK_SIZE);
+    }
+    void readv(unsigned block_num, const iovec *iov, int iovcnt) override
+    {
+        uint8_t *p = _map + (size_t)block_num * BLOCK_SIZE;
+        for (int i = 0; i < iovcnt; p += iov[i].iov_len, i++)
+            memcpy(iov[i].iov_base, p, iov[i].iov_len);
+    }
+    void writev(unsigned block_num, const iovec *iov, int iovcnt) override
+    {
+        uint8_t *p = _map + (size_t)block_num * BLOCK_SIZE;
+        for (int i = 0; i < iovcnt; p += iov[i].iov_len, i++)
+            memcpy(p, iov[i].iov_base, iov[i].iov_len);
+    }
+    void sync() override
+    {
+        // Schedule the writeback like fflush() does, MS_SYNC would be the fsync() equivalent.
+        auto s = msync(_map, DISK_SIZE, MS_ASYNC);
+        assert(s == 0);
+    }
+    uint8_t *block_ptr(unsigned block_num) override
+    {
+        return _map + (size_t)block_num * BLOCK_SIZE;
+    }
+    void willneed(unsigned block_num, size_t n) override
+    {
+        // The kernel starts reading the pages in and returns at once.
+        static const size_t page = sysconf(_SC_PAGESIZE);
+        size_t begin = (size_t)block_num * BLOCK_SIZE / page * page;
+        size_t end = std::min<size_t>((size_t)(block_num + n) * BLOCK_SIZE, DISK_SIZE);
+        madvise(_map + begin, end - begin, MADV_WILLNEED);
+    }
+};
+
+enum class DiskBackend
+{
+    STDIO, // FILE* + fseek/fread/fwrite
+    POSIX, // fd + pread/pwrite
+    MMAP,  // shared mapping of the whole image
+};
+
+class Disk
+{
+private:
+    std::unique_ptr<BlockDevice> _dev;
+    std::unique_ptr<IOEngine> _engine;
+
+    void _rw_list(bool write, const uint32_t *blocks, size_t n, void *buf)
+    {
+        std::vector<iovec> iov;
+        std::vector<io_request> reqs;
+        iov.reserve(n);
+        size_t i = 0;
+        while (i < n)
+        {
+            size_t j = i + 1;
+            while (j < n and blocks[j] == blocks[j - 1] + 1)
+                j++;
+            assert(blocks[i] + (j - i) <= DISK_SIZE / BLOCK_SIZE);
+            iov.push_back({(uint8_t *)buf + i * BLOCK_SIZE, (j - i) * BLOCK_SIZE});
+            io_request r = {write, blocks[i], nullptr};
+            reqs.push_back(r);
+            i = j;
+        }
+        for (size_t k = 0; k < reqs.size(); k++)
+        {
+            reqs[k].iov = &iov[k];
+            reqs[k].iovcnt = 1;
+        }
+        submit(reqs.data(), reqs.size());
+    }
+
+public:
+    Disk(const char *_path, DiskBackend backend = DiskBackend::POSIX)
+    {
+        switch (backend)
+        {
+        case DiskBackend::STDIO:
+            _dev.reset(new StdioDevice(_path));
+            break;
+        case DiskBackend::POSIX:
+            _dev.reset(new PosixDevice(_path));
+            break;
+        case DiskBackend::MMAP:
+            _dev.reset(new MmapDevice(_path));
+            break;
+        default:
+            assert(0);
+        }
+        if (mapped())
+            return;
+#ifdef EXT2M_HAVE_IO_URING
+        if (_dev->fd() != -1)
+        {
+            auto *uring = new UringEngine(_dev->fd());
+            if (uring->ok())
+                _engine.reset(uring);
+            else
+                delete uring;
+        }
+#endif
+        if (not _engine)
+        {
+            auto *dev = _dev.get();
+            auto exec = [dev](const io_request &r)
+            {
+                if (r.iov)
+                {
+                    if (r.write)
+                        dev->writev(r.block_num, r.iov, r.iovcnt);
+                    else
+                        dev->readv(r.block_num, r.iov, r.iovcnt);
+                }
+                else if (r.write)
+                    dev->write_block(r.block_num, r.buf);
+                else
+                    dev->read_block(r.block_num, r.buf);
+            };
+            _engine.reset(new ThreadPoolEngine(exec));
+        }
+    }
+    void read_block(unsigned block_num, void *buf)
+    {
+        assert(block_num < DISK_SIZE / BLOCK_SIZE);
+        assert(buf != nullptr);
+        _dev->read_block(block_num, buf);
+    }
+    void write_block(unsigned block_num, const void *buf)
+    {
+        assert(block_num < DISK_SIZE / BLOCK_SIZE);
+        assert(buf != nullptr);
+        _dev->write_block(block_num, buf);
+    }
+    /**
+     * @brief Issue a batch of block reads/writes with all of them in flight at once, and wait for them to complete.
+     *
+     * @param reqs
+     * @param n
+     */
+    void submit(const io_request *reqs, size_t n)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            assert(reqs[i].block_num < DISK_SIZE / BLOCK_SIZE);
+            assert(reqs[i].buf != nullptr or reqs[i].iov != nullptr);
+        }
+        if (not _engine)
+        {
+            for (size_t i = 0; i < n; i++)
+            {
+                auto &&r = reqs[i];
+                if (r.iov)
+                {
+                    if (r.write)
+                        _dev->writev(r.block_num, r.iov, r.iovcnt);
+                    else
+                        _dev->readv(r.block_num, r.iov, r.iovcnt);
+                }
+                else if (r.write)
+                    _dev->write_block(r.block_num, r.buf);
+                else
+                    _dev->read_block(r.block_num, r.buf);
+            }
+            return;
+        }
+        _engine->submit(reqs, n);
+    }
+    /**
+     * @brief Read n consecutive blocks with a single request.
+     *
+     * @param start first block
+     * @param n
+     * @param buf n * BLOCK_SIZE bytes
+     */
+    void read_blocks(unsigned start, size_t n, void *buf)
+    {
+        assert(start + n <= DISK_SIZE / BLOCK_SIZE);
+        iovec iov = {buf, n * BLOCK_SIZE};
+        _dev->readv(start, &iov, 1);
+    }
+    /**
+     * @brief Write n consecutive blocks with a single request.
+     *
+     * @param start first block
+     * @param n
+     * @param buf n * BLOCK_SIZE bytes
+     */
+    void write_blocks(unsigned start, size_t n, const void *buf)
+    {
+        assert(start + n <= DISK_SIZE / BLOCK_SIZE);
+        iovec iov = {(void *)buf, n * BLOCK_SIZE};
+        _dev->writev(start, &iov, 1);
+    }
+    /**
+     * @brief Read consecutive blocks into scattered buffers (preadv).
+     *
+     * @param start first block
+     * @param iov buffers, each iov_len is a multiple of BLOCK_SIZE
+     * @param iovcnt
+     */
+    void readv(unsigned start, const iovec *iov, int iovcnt)
+    {
+        _dev->readv(start, iov, iovcnt);
+    }
+    /**
+     * @brief Write scattered buffers to consecutive blocks (pwritev).
+     *
+     * @param start first block
+     * @param iov buffers, each iov_len is a multiple of BLOCK_SIZE
+     * @param iovcnt
+     */
+    void writev(unsigned start, const iovec *iov, int iovcnt)
+    {
+        _dev->writev(start, iov, iovcnt);
+    }
+    /**
+     * @brief Read a list of blocks into one buffer. Runs of physically adjacent blocks become one request each,
+     * and all requests are in flight at once.
+     *
+     * @param blocks block indexes
+     * @param n
+     * @param buf n * BLOCK_SIZE bytes, blocks[i] goes to buf + i * BLOCK_SIZE
+     */
+    void readv_blocks(const uint32_t *blocks, size_t n, void *buf)
+    {
+        _rw_list(false, blocks, n, buf);
+    }
+    /**
+     * @brief Write one buffer to a list of blocks, coalescing physically adjacent blocks.
+     *
+     * @param blocks block indexes
+     * @param n
+     * @param buf n * BLOCK_SIZE bytes, buf + i * BLOCK_SIZE goes to blocks[i]
+     */
+    void writev_blocks(const uint32_t *blocks, size_t n, const void *buf)
+    {
+        _rw_list(true, blocks, n, (void *)buf);
+    }
+    /**
+     * @brief Name of the batch I/O engine in use.
+     */
+    const char *engine() const
+    {
+        return _engine ? _engine->name() : "inline";
+    }
+    void sync()
+    {
+        _dev->sync();
+    }
+    /**
+     * @brief Get a pointer to the block's bytes on a memory-mapped disk.
+     * @return nullptr if the backend is not memory-mapped.
+     */
+    uint8_t *block_ptr(unsigned block_num)
+    {
+        assert(block_num < DISK_SIZE / BLOCK_SIZE);
+        return _dev->block_ptr(block_num);
+    }
+    bool mapped()
+    {
+        return _dev->block_ptr(0) != nullptr;
+    }
+    void willneed(unsigned block_num, size_t n)
+    {
+        assert(block_num + n <= DISK_SIZE / BLOCK_SIZE);
+        _dev->willneed(block_num, n);
+    }
+};
+
+#endif
@@ -76,6 +76,20 @@ using __u32 = uint32_t;
 #define EXT2_FT_SOCK 0x06     // socket
 #define EXT2_FT_SYMLINK 0x07  // symbolic link
 
+// Compatible feature: directories may be hash indexed (htree), as in ext3
+#define EXT2_FEATURE_COMPAT_DIR_INDEX 0x0020
+// Inode flag: the directory is hash indexed, its first block holds the root of the index
+#define EXT2_INDEX_FL 0x00001000
+#define DX_HASH_LEGACY_UNSIGNED 0x03
+
+// Incompatible feature: some inodes map their blocks with an extent tree, as in ext4
+#define EXT4_FEATURE_INCOMPAT_EXTENTS 0x0040
+// Inode flag: i_block holds the root of an extent tree instead of block pointers
+#define EXT4_EXTENTS_FL 0x00080000
+#define EXT4_EXT_MAGIC 0xF30A
+// The longest extent, longer ones mark uninitialized extents in ext4
+#define EXT4_EXT_INIT_MAX_LEN (1 << 15)
+
 /*
  * Structure of the super block
  */
@@ -288,6 +302,65 @@ struct ext2_dir_entry_2
                  // The name must be no longer than 255 bytes after encoding
 } __attribute__((packed));
 
+/*
+ * Extent tree, a node is i_block or a whole block: a header, then extents in a leaf or indexes above.
+ * The entries are sorted by the first file block they cover.
+ */
+struct ext4_extent_header
+{
+    __le16 eh_magic;      /* EXT4_EXT_MAGIC */
+    __le16 eh_entries;    /* number of valid entries */
+    __le16 eh_max;        /* capacity of store in entries */
+    __le16 eh_depth;      /* 0 for a leaf, else the number of levels below */
+    __le32 eh_generation; /* generation of the tree */
+} __attribute__((packed));
+
+// A run of blocks, in a leaf
+struct ext4_extent
+{
+    __le32 ee_block;    /* first logical block extent covers */
+    __le16 ee_len;      /* number of blocks covered by extent */
+    __le16 ee_start_hi; /* high 16 bits of physical block */
+    __le32 ee_start_lo; /* low 32 bits of physical block */
+} __attribute__((packed));
+
+// A child node, in an index node
+struct ext4_extent_idx
+{
+    __le32 ei_block;   /* index covers logical blocks from 'block' */
+    __le32 ei_leaf_lo; /* pointer to the physical block of the next level */
+    __le16 ei_leaf_hi; /* high 16 bits of physical block */
+    __u16 ei_unused;
+} __attribute__((packed));
+
+/*
+ * Hash indexed directory. The first block keeps "." and "..", the latter spanning the rest of the block,
+ * followed by dx_root_info and the root dx_entry array. An index node is an empty entry spanning the whole block,
+ * followed by a dx_entry array. The first dx_entry of an array holds a dx_countlimit instead of its hash.
+ * Blocks are numbered within the directory.
+ */
+struct dx_root_info
+{
+    __le32 reserved_zero;
+    __u8 hash_version; /* DX_HASH_LEGACY_UNSIGNED */
+    __u8 info_length;  /* 8 */
+    __u8 indirect_levels;
+    __u8 unused_flags;
+} __attribute__((packed));
+
+struct dx_countlimit
+{
+    __le16 limit; /* entries the array can hold */
+    __le16 count; /* entries in use */
+} __attribute__((packed));
+
+// The child block holding the hashes from hash up to the next entry's
+struct dx_entry
+{
+    __le32 hash;
+    __le32 block;
+} __attribute__((packed));
+
 constexpr auto SUPER_BLOCK_SIZE = sizeof(ext2_super_block);
 constexpr auto GROUP_DESC_SIZE = sizeof(ext2_group_desc);
 constexpr auto INODE_SIZE = sizeof(ext2_inode);
@@ -9,6 +9,12 @@
 #include <functional>
 #include <string>
 #include <iostream>
+#include <mutex>
+#include <map>
+#include <set>
+#include <list>
+#include <unordered_map>
+#include <algorithm>
 
 /*
  * TODOLISTS:
@@ -78,35 +84,152 @@ namespace Ext2m
         __u8 file_type;
         std::string name;
     };
+    /**
+     * @brief Optional features of the images Ext2m formats. An existing image keeps the features it was formatted with.
+     */
+    struct format_options
+    {
+        bool extents = FORMAT_EXTENTS;     // EXT4_FEATURE_INCOMPAT_EXTENTS, files and directories are mapped by extents
+        bool dir_index = FORMAT_DIR_INDEX; // EXT2_FEATURE_COMPAT_DIR_INDEX, large directories get a hash index
+    };
+    /**
+     * Lookups (get_inode, get_inode_all_entry, lookup_entry, get_inode_all_blocks, bmap) and write_inode may run concurrently,
+     * everything else must be serialized by the caller.
+     */
     class Ext2m
     {
         uint8_t _buf[BLOCK_SIZE];
+        std::mutex _inode_mtx;
 
         size_t full_group_count;
         size_t blocks_per_group;
         size_t group_desc_block_count;
         size_t inodes_table_block_count;
 
+        const format_options _fmt; // used when the image has to be formatted
         ext2_super_block _superb;
-        ext2_group_desc *_group_desc;
+        ext2_group_desc *_group_desc = nullptr; // the free counters are kept up to date here and written back on sync
+        bool _summary_dirty = false;            // _superb or _group_desc changed since they were last written back
+
+        // One bit per 64 blocks of the block bitmaps, set when one of them is free. In memory only, rebuilt at mount.
+        std::unique_ptr<BitMap> _free_words;
+        size_t words_per_group;
+
+        // A window of blocks set aside for a file being written. It lives in memory only, a block is set in the bitmap
+        // when it is handed out, so a crash loses nothing. New windows avoid the other files' windows, allocations
+        // outside of reservations may still take blocks from one.
+        struct reservation
+        {
+            uint32_t next = 0;   // first block of the window not handed out yet
+            uint32_t end = 0;    // one past the last block of the window
+            uint32_t window = 0; // size of the last window, it doubles every time one is used up
+        };
+        std::map<uint32_t, reservation> _reservations;               // by inode num
+        std::map<uint32_t /*end*/, uint32_t /*inode num*/> _windows; // the reservations' windows, they do not overlap
+
+        // Inodes in memory, by inode num, guarded by _inode_mtx. Written back to the inode table on sync, or when evicted.
+        // The server syncs every expire_ms, so the inode table does not fall behind the bitmaps the cache flushes.
+        struct icache_item
+        {
+            ext2_inode inode;
+            unsigned refs = 0; // open files, a referenced inode is never evicted
+            bool dirty = false;
+            std::list<uint32_t>::iterator lru;
+        };
+        std::unordered_map<uint32_t, icache_item> _icache;
+        std::list<uint32_t> _icache_lru; // most recently used first
+        std::set<uint32_t> _dirty_inodes; // in inode table order, a sync walks only these
+
+        /**
+         * @brief The inode table block holding an inode, and the inode's place in it.
+         */
+        BlockRef inode_table_block(size_t inode_num, size_t &offset)
+        {
+            assert(inode_num >= 1);
+            inode_num--;
+            size_t group_index = inode_num / inodes_per_group;
+            size_t ind = inode_num % inodes_per_group;
+            assert(group_index < full_group_count);
+            auto inode_table_block_ind = get_inode_table_index(group_index);
+
+            //     BLOCK_SIZE / INODE_SIZE; // 8 inodes per block
+            size_t block_index = ind / 8;
+            offset = ind % 8;
+            return _disk.get(inode_table_block_ind + block_index);
+        }
+
+        void iwrite_back(uint32_t inode_num, icache_item &item)
+        {
+            size_t offset;
+            auto ref = inode_table_block(inode_num, offset);
+            ref.as<ext2_inode>()[offset] = item.inode;
+            ref.mark_dirty();
+            item.dirty = false;
+            _dirty_inodes.erase(inode_num);
+        }
+
+        /**
+         * @brief The icache entry of an inode, read from the inode table unless load is false. _inode_mtx must be held.
+         * Unreferenced inodes are evicted, least recently used first, once there are more than ICACHE_SIZE.
+         */
+        icache_item &icache_get(uint32_t inode_num, bool load = true)
+        {
+            auto it = _icache.find(inode_num);
+            if (it != _icache.end())
+            {
+                _icache_lru.splice(_icache_lru.begin(), _icache_lru, it->second.lru);
+                return it->second;
+            }
+            auto &&item = _icache[inode_num];
+            if (load)
+            {
+                size_t offset;
+                auto ref = inode_table_block(inode_num, offset);
+                item.inode = ref.as<ext2_inode>()[offset];
+            }
+            _icache_lru.push_front(inode_num);
+            item.lru = _icache_lru.begin();
+            for (auto victim = std::prev(_icache_lru.end()); _icache.size() > ICACHE_SIZE and victim != _icache_lru.begin();)
+            {
+                auto &&v = _icache[*victim];
+                auto prev = std::prev(victim);
+                if (v.refs == 0)
+                {
+                    if (v.dirty)
+                        iwrite_back(*victim, v);
+                    _icache.erase(*victim);
+                    _icache_lru.erase(victim);
+                }
+                victim = prev;
+            }
+            return item;
+        }
 
         /**
-         * @brief check if the disk is ext2-format disk
-         * @return boolean
+         * @brief check if the disk is ext2-format disk. Exits if it is one with a layout or features this build cannot handle.
+         * @return false if there is no ext2 super block
          */
         bool check_is_ext2_format()
         {
             // only works for BLOCK_SIZE = 1KB
             _disk.read_block(1, _buf);
             auto *sb = (ext2_super_block *)_buf;
+            if (sb->s_magic != EXT2_SUPER_MAGIC)
+                return false;
+            // An ext2 image this build cannot use is never formatted over.
             bool flag = true;
-            flag &= sb->s_magic == EXT2_SUPER_MAGIC;
             flag &= (1024 << (sb->s_log_block_size)) == BLOCK_SIZE;
             flag &= sb->s_first_data_block == 1;
             flag &= sb->s_inodes_per_group <= 8 * BLOCK_SIZE;
             flag &= sb->s_first_ino == EXT2_GOOD_OLD_FIRST_INO;
             flag &= sb->s_inode_size == INODE_SIZE;
-            return flag;
+            flag &= (sb->s_feature_incompat & ~EXT4_FEATURE_INCOMPAT_EXTENTS) == 0;
+            if (not flag)
+            {
+                fprintf(stderr, "ext2m: unsupported layout or incompatible features (0x%x), not mounted\n", sb->s_feature_incompat);
+                exit(1);
+            }
+            return true;
         }
 
         /**
@@ -206,56 +329,38 @@ namespace Ext2m
         }
 
         /**
-         * @brief Get the block-group's {block bitmap} object
-         *
-         * @param group_index
-         * @return BitMap
-         */
-        BitMap get_block_bitmap(size_t group_index)
-        {
-            _disk.read_block(get_block_bitmap_index(group_index), _buf);
-            return BitMap(_buf, blocks_per_group);
-        }
-        /**
-         * @brief Get the block-group's {inode bitmap} object
-         *
-         * @param group_index
-         * @return BitMap
+         * @brief A group bitmap viewed in place in its pinned cache block.
+         * Changes go straight to the cached block, call mark_dirty() after them.
          */
-        BitMap get_inode_bitmap(size_t group_index)
+        struct bitmap_ref : public BitMap
         {
-            _disk.read_block(get_inode_bitmap_index(group_index), _buf);
-            return BitMap(_buf, inodes_per_group);
-        }
+            BlockRef block;
+            bitmap_ref(BlockRef &&ref, unsigned size) : BitMap(ref.data(), size, false), block(std::move(ref)) {}
+            void mark_dirty()
+            {
+                block.mark_dirty();
+            }
+        };
+
         /**
-         * @brief Write the block-group's {block bitmap} object to the disk.
+         * @brief Get the block-group's {block bitmap} object
          *
          * @param group_index
-         * @param bitmap
+         * @return bitmap_ref
          */
-        void write_block_bitmap(size_t group_index, const BitMap &bitmap)
+        bitmap_ref get_block_bitmap(size_t group_index)
         {
-            auto tmp = bitmap.data();
-            const void *buf = tmp.first;
-            unsigned size = tmp.second;
-            memset(_buf, 0, BLOCK_SIZE);
-            memcpy(_buf, buf, size);
-            _disk.write_block(get_block_bitmap_index(group_index), _buf);
+            return bitmap_ref(_disk.get(get_block_bitmap_index(group_index)), blocks_per_group);
         }
         /**
-         * @brief Write the block-group's {inode bitmap} object to the disk.
+         * @brief Get the block-group's {inode bitmap} object
          *
          * @param group_index
-         * @param bitmap
+         * @return bitmap_ref
          */
-        void write_inode_bitmap(size_t group_index, const BitMap &bitmap)
+        bitmap_ref get_inode_bitmap(size_t group_index)
         {
-            auto tmp = bitmap.data();
-            const void *buf = tmp.first;
-            unsigned size = tmp.second;
-            memset(_buf, 0, BLOCK_SIZE);
-            memcpy(_buf, buf, size);
-            _disk.write_block(get_inode_bitmap_index(group_index), _buf);
+            return bitmap_ref(_disk.get(get_inode_bitmap_index(group_index)), inodes_per_group);
         }
         /**
          * @brief read nessary information from the super block.
@@ -281,124 +386,91 @@ namespace Ext2m
         }
 
         /**
-         * @brief Get the inode all blocks indexes into a vector. Recursively find all the blocks.
-         *
-         * @param _block_ind
-         * @param level
-         * @param arr
-         * @return true for continue traverse, false  for reach the end
+         * @brief Load the super block and the group descriptors, then recount every group's free blocks and inodes
+         * from the bitmaps, the counters on disk are only as fresh as the last sync.
          */
-        bool __get_inode_all_blocks__(uint32_t _block_ind, int level, std::vector<uint32_t> &arr)
+        void load_summary()
         {
-            assert(level < 4 and level >= 0);
-            if (_block_ind == EXT2M_I_BLOCK_END)
-                return false;
-            if (level == 0) // direct access block
             {
-                arr.push_back(_block_ind);
-                return true;
+                auto ref = _disk.get(get_super_block_index(0));
+                _superb = *ref.as<ext2_super_block>();
             }
-            else // the all indirect block
+            delete[] _group_desc;
+            _group_desc = new ext2_group_desc[full_group_count];
+            size_t size = sizeof(ext2_group_desc) * full_group_count;
+            for (size_t i = 0; i < group_desc_block_count; i++)
             {
-                std::unique_ptr<uint8_t[]> mbuf(new uint8_t[BLOCK_SIZE]);
-                _disk.read_block(_block_ind, mbuf.get());
-                uint8_t *_start = mbuf.get();
-                uint8_t *_end = _start + BLOCK_SIZE;
-                bool flag = true;
-                while (_start != _end)
-                {
-                    __le32 bn = *(__le32 *)_start;
-                    _start += sizeof(__le32);
-                    flag &= __get_inode_all_blocks__(bn, level - 1, arr);
-                    if (not flag)
-                        return false;
-                }
-                return true;
+                auto ref = _disk.get(get_group_desc_table_index(0) + i);
+                memcpy((uint8_t *)_group_desc + i * BLOCK_SIZE, ref.data(), std::min<size_t>(BLOCK_SIZE, size - i * BLOCK_SIZE));
+            }
+            _superb.s_free_blocks_count = 0;
+            _superb.s_free_inodes_count = 0;
+            words_per_group = ceil(blocks_per_group, 64);
+            std::vector<uint8_t> zero(ceil(full_group_count * words_per_group, BYTEINBITS));
+            _free_words.reset(new BitMap(zero.data(), full_group_count * words_per_group));
+            for (size_t i = 0; i < full_group_count; i++)
+            {
+                auto &&desc = _group_desc[i];
+                auto &&bitmap = get_block_bitmap(i);
+                desc.bg_free_blocks_count = bitmap.count(0, false);
+                for (uint32_t w = 0; w < words_per_group; w++)
+                    update_free_word(i, bitmap, w * 64);
+                // The reserved inodes below s_first_ino are never handed out.
+                desc.bg_free_inodes_count = get_inode_bitmap(i).count(i == 0 ? _superb.s_first_ino - 1 : 0, false);
+                _superb.s_free_blocks_count += desc.bg_free_blocks_count;
+                _superb.s_free_inodes_count += desc.bg_free_inodes_count;
             }
+            _summary_dirty = true;
         }
 
         /**
-         * @brief Add a block to an inode. Recursively.
-         *
-         * @param _block_ind the inode's block index
-         * @param level 0 for direct access block, 1 for the first indirect block, 2 for the second indirect block, 3 for the third indirect block.
-         * @param group_index
-         * @return ssize_t the block index added to the inode.
+         * @brief Write the in-memory super block and group descriptors over the primary copies in group 0,
+         * if they changed since the last time.
          */
-        ssize_t __add_block_to_inode__(uint32_t _block_ind, int level, uint32_t group_index)
+        void write_summary()
         {
-            switch (level)
-            {
-            case 1:
-            {
-                _disk.read_block(_block_ind, _buf);
-                uint32_t *_start = (uint32_t *)_buf;
-                uint32_t *_end = _start + BLOCK_SIZE / sizeof(uint32_t);
-                while (_start != _end)
-                {
-                    if (*_start == EXT2M_I_BLOCK_END)
-                    {
-                        auto n = ballocs(group_index, 1).front();
-                        *_start = n;
-                        _disk.write_block(_block_ind, _buf);
-                        return n;
-                    }
-                    _start++;
-                }
-                return -1;
-                break;
-            }
-            case 2:
+            if (_group_desc == nullptr or not _summary_dirty)
+                return;
+            _summary_dirty = false;
             {
-                std::unique_ptr<uint8_t[]> mbuf(new uint8_t[BLOCK_SIZE]);
-                _disk.read_block(_block_ind, mbuf.get());
-                uint32_t *_start = (uint32_t *)mbuf.get();
-                uint32_t *_end = _start + BLOCK_SIZE / sizeof(uint32_t);
-                while (_start != _end)
-                {
-                    if (*_start == EXT2M_I_BLOCK_END)
-                    {
-                        auto n = ballocs(group_index, 1).front();
-                        *_start = n;
-                        _disk.write_block(_block_ind, mbuf.get());
-                        memset(_buf, 0, BLOCK_SIZE);
-                        _disk.write_block(n, _buf);
-                        auto ret = __add_block_to_inode__(n, level - 1, group_index);
-                        return ret;
-                    }
-                    _start++;
-                }
-                return -1;
-                break;
+                auto ref = _disk.get(get_super_block_index(0));
+                memcpy(ref.data(), &_superb, sizeof(_superb));
+                ref.mark_dirty();
             }
-            case 3:
+            size_t size = sizeof(ext2_group_desc) * full_group_count;
+            for (size_t i = 0; i < group_desc_block_count; i++)
             {
-                std::unique_ptr<uint8_t[]> mbuf(new uint8_t[BLOCK_SIZE]);
-                _disk.read_block(_block_ind, mbuf.get());
-                uint32_t *_start = (uint32_t *)mbuf.get();
-                uint32_t *_end = _start + BLOCK_SIZE / sizeof(uint32_t);
-                while (_start != _end)
-                {
-                    if (*_start == EXT2M_I_BLOCK_END)
-                    {
-                        auto n = ballocs(group_index, 1).front();
-                        *_start = n;
-                        _disk.write_block(_block_ind, mbuf.get());
-                        memset(_buf, 0, BLOCK_SIZE);
-                        _disk.write_block(n, _buf);
-                        auto ret = __add_block_to_inode__(n, level - 1, group_index);
-                        return ret;
-                    }
-                    _start++;
-                }
-                return -1;
-                break;
-            }
-            default:
-                assert(0);
-                break;
+                auto ref = _disk.get(get_group_desc_table_index(0) + i);
+                memcpy(ref.data(), (uint8_t *)_group_desc + i * BLOCK_SIZE, std::min<size_t>(BLOCK_SIZE, size - i * BLOCK_SIZE));
+                ref.mark_dirty();
             }
-            return -1;
+        }
+
+        /**
+         * @brief Refresh the summary bit of the 64 blocks around bit of the group's block bitmap.
+         */
+        void update_free_word(size_t group_index, const BitMap &bitmap, uint32_t bit)
+        {
+            uint32_t w = bit / 64;
+            size_t pos = group_index * words_per_group + w;
+            if (bitmap.nextBit(w * 64) < (w + 1) * 64)
+                _free_words->set(pos);
+            else
+                _free_words->reset(pos);
+        }
+
+        void count_free_blocks(size_t group_index, int delta)
+        {
+            _group_desc[group_index].bg_free_blocks_count += delta;
+            _superb.s_free_blocks_count += delta;
+            _summary_dirty = true;
+        }
+
+        void count_free_inodes(size_t group_index, int delta)
+        {
+            _group_desc[group_index].bg_free_inodes_count += delta;
+            _superb.s_free_inodes_count += delta;
+            _summary_dirty = true;
         }
 
         struct entry_block
@@ -418,6 +490,9 @@ namespace Ext2m
              */
             bool next_entry(entry &e)
             {
+                // an entry with inode 0 is free space: an emptied first entry, or an index node
+                while (_now != _end and ((ext2_dir_entry_2 *)_now)->inode == 0)
+                    _now += ((ext2_dir_entry_2 *)_now)->rec_len;
                 if (_now == _end)
                     return false;
                 ext2_dir_entry_2 *ent = (ext2_dir_entry_2 *)_now;
@@ -441,12 +516,13 @@ namespace Ext2m
                 while (_now != _end)
                 {
                     ext2_dir_entry_2 *ent = (ext2_dir_entry_2 *)_now;
-                    size_t ent_size = roundup(ent->name_len + 1 + sizeof(ext2_dir_entry_2), 4);
+                    size_t ent_size = ent->inode == 0 ? 0 : roundup(ent->name_len + 1 + sizeof(ext2_dir_entry_2), 4);
                     assert(ent->rec_len >= ent_size);
                     size_t remain_size = ent->rec_len - ent_size;
                     if (remain_size >= e_size)
                     {
-                        ent->rec_len = ent_size;
+                        if (ent_size > 0)
+                            ent->rec_len = ent_size;
                         ext2_dir_entry_2 *tar = (ext2_dir_entry_2 *)(_now + ent_size);
                         tar->inode = e.inode;
                         tar->file_type = e.file_type;
@@ -480,6 +556,12 @@ namespace Ext2m
                         assert(strcmp((char *)ent->name, ".") != 0);
                         assert(strcmp((char *)ent->name, "..") != 0);
 
+                        if (_pre == nullptr)
+                        {
+                            // the first entry of a block keeps its space
+                            ent->inode = 0;
+                            return true;
+                        }
                         ext2_dir_entry_2 *precd = (ext2_dir_entry_2 *)_pre;
                         precd->rec_len += ent->rec_len;
 
@@ -492,16 +574,30 @@ namespace Ext2m
                 }
                 return false;
             }
+
+            /**
+             * @brief The inode of the entry called name, 0 if there is none.
+             */
+            uint32_t find(const std::string &name) const
+            {
+                for (uint8_t *p = _block; p != _end; p += ((ext2_dir_entry_2 *)p)->rec_len)
+                {
+                    ext2_dir_entry_2 *ent = (ext2_dir_entry_2 *)p;
+                    if (ent->inode != 0 and ent->name_len == name.size() and memcmp(ent->name, name.data(), name.size()) == 0)
+                        return ent->inode;
+                }
+                return 0;
+            }
         };
 
         uint32_t get_father_inode_num(uint32_t inode_num)
         {
             ext2_inode inode;
             get_inode(inode_num, inode);
-            auto n = inode.i_block[0];
-            assert(n != 0);
-            _disk.read_block(n, _buf);
-            entry_block eb(_buf);
+            auto n = block_iterator(*this, inode, 0).next();
+            assert(n != EXT2M_I_BLOCK_END);
+            auto ref = _disk.get(n);
+            entry_block eb(ref.data());
             entry e;
             while (eb.next_entry(e))
             {
@@ -516,22 +612,15 @@ namespace Ext2m
         size_t inodes_per_group;
         Cache &_disk;
 
-        Ext2m(Cache &cache) : _disk(cache)
+        Ext2m(Cache &cache, const format_options &fmt = format_options()) : _fmt(fmt), _disk(cache)
         {
             if (not check_is_ext2_format())
                 format();
             else
-                read_info();
-            _disk.read_block(1, _buf);
-            this->_superb = *(ext2_super_block *)_buf;
-            this->_group_desc = new ext2_group_desc[full_group_count];
-            uint8_t *buf = new uint8_t[BLOCK_SIZE * group_desc_block_count];
-            for (size_t i = 0; i < group_desc_block_count; i++)
             {
-                _disk.read_block(2 + i, buf + i * BLOCK_SIZE);
+                read_info();
+                load_summary();
             }
-            memcpy(_group_desc, buf, sizeof(ext2_group_desc) * full_group_count);
-            delete[] buf;
         };
         ~Ext2m()
         {
@@ -543,14 +632,42 @@ namespace Ext2m
          */
         void sync()
         {
+            {
+                std::lock_guard<std::mutex> lock(_inode_mtx);
+                while (not _dirty_inodes.empty())
+                {
+                    auto inode_num = *_dirty_inodes.begin();
+                    iwrite_back(inode_num, _icache.at(inode_num));
+                }
+            }
+            write_summary();
             _disk.flush_all();
         }
 
+        const ext2_super_block &super_block() const
+        {
+            return _superb;
+        }
+        const ext2_group_desc &group_desc(size_t group_index) const
+        {
+            assert(group_index < full_group_count);
+            return _group_desc[group_index];
+        }
+        size_t group_count() const
+        {
+            return full_group_count;
+        }
+
         /**
          * @brief Format the disk to ext2 format and add root directory
          */
         void format()
         {
+            _icache.clear();
+            _icache_lru.clear();
+            _dirty_inodes.clear();
+            _reservations.clear();
+            _windows.clear();
             // Boot sector
             strcpy((char *)_buf, "EXT2FS , THIS THE FIRST BLOCK FOR BLCOK SIZE = 1KB , THIS IS THE BOOT SECTOR");
             _disk.write_block(0, _buf);
@@ -613,8 +730,8 @@ namespace Ext2m
                 super_block.s_first_ino = EXT2_GOOD_OLD_FIRST_INO;
                 super_block.s_inode_size = INODE_SIZE;
                 super_block.s_block_group_nr = 0;
-                super_block.s_feature_compat = 0;
-                super_block.s_feature_incompat = 0;
+                super_block.s_feature_compat = _fmt.dir_index ? EXT2_FEATURE_COMPAT_DIR_INDEX : 0;
+                super_block.s_feature_incompat = _fmt.extents ? EXT4_FEATURE_INCOMPAT_EXTENTS : 0;
                 super_block.s_feature_ro_compat = 0;
                 memset(super_block.s_uuid, 0, sizeof(super_block.s_uuid));
                 strcpy((char *)super_block.s_volume_name, "*.img");
@@ -630,7 +747,7 @@ namespace Ext2m
                 super_block.s_journal_dev = 0;
                 super_block.s_last_orphan = 0;
                 memset(super_block.s_hash_seed, 0, sizeof(super_block.s_hash_seed));
-                super_block.s_def_hash_version = 0;
+                super_block.s_def_hash_version = DX_HASH_LEGACY_UNSIGNED;
                 super_block.s_default_mount_opts = 0;
                 super_block.s_first_meta_bg = 0;
             }
@@ -686,14 +803,17 @@ namespace Ext2m
                     start_ind++;
                 }
                 auto &&bm = get_block_bitmap(i);
+                bm.resetAll();
                 size_t _end = 3 + group_desc_block_count + inodes_table_block_count;
                 for (size_t _j = 0; _j < _end; _j++)
                 {
                     bm.set(_j);
                 }
-                write_block_bitmap(i, bm);
+                bm.mark_dirty();
             }
 
+            load_summary();
+            _group_desc[0].bg_used_dirs_count = 1; // the root directory
             sync();
 
             // // super_block.s_first_ino == 11
@@ -702,7 +822,7 @@ namespace Ext2m
             auto &&bm = get_inode_bitmap(0);
             // The root directory is Inode 2
             bm.set(2);
-            write_inode_bitmap(0, bm);
+            bm.mark_dirty();
             // see ext2.pdf page 18
             ext2_inode root_ino;
             {
@@ -752,10 +872,11 @@ namespace Ext2m
         {
             std::vector<entry> ret;
             auto all_blocks = get_inode_all_blocks(inode_num);
+            uint8_t buf[BLOCK_SIZE];
             for (auto &&i : all_blocks)
             {
-                _disk.read_block(i, _buf);
-                entry_block eb(_buf);
+                _disk.read_block(i, buf);
+                entry_block eb(buf);
                 entry e;
                 while (eb.next_entry(e))
                 {
@@ -767,17 +888,90 @@ namespace Ext2m
             return ret;
         }
 
+        /**
+         * @brief Pick the group of a new directory, the Orlov way.
+         * A top-level directory goes to the group with the fewest directories among those with at least the average free inodes and blocks,
+         * so the trees below it spread over the disk. Any other directory stays near its parent,
+         * in the first group from the parent's on that is not crowded with directories and still has room.
+         */
+        size_t find_group_dir(uint32_t parent_inode)
+        {
+            size_t ngroups = full_group_count;
+            size_t avefreei = _superb.s_free_inodes_count / ngroups;
+            size_t avefreeb = _superb.s_free_blocks_count / ngroups;
+            size_t ndirs = 0;
+            for (size_t i = 0; i < ngroups; i++)
+                ndirs += _group_desc[i].bg_used_dirs_count;
+
+            if (parent_inode == ROOT_INODE)
+            {
+                size_t best = ngroups;
+                for (size_t i = 0; i < ngroups; i++)
+                {
+                    auto &&desc = _group_desc[i];
+                    if (desc.bg_free_inodes_count == 0 or desc.bg_free_inodes_count < avefreei or desc.bg_free_blocks_count < avefreeb)
+                        continue;
+                    if (best == ngroups or desc.bg_used_dirs_count < _group_desc[best].bg_used_dirs_count)
+                        best = i;
+                }
+                if (best != ngroups)
+                    return best;
+            }
+            else
+            {
+                size_t parent_group = (parent_inode - 1) / inodes_per_group;
+                size_t max_dirs = ndirs / ngroups + inodes_per_group / 16;
+                size_t min_inodes = inodes_per_group / 4;
+                size_t min_blocks = blocks_per_group / 4;
+                for (size_t k = 0; k < ngroups; k++)
+                {
+                    auto &&desc = _group_desc[(parent_group + k) % ngroups];
+                    if (desc.bg_used_dirs_count < max_dirs and desc.bg_free_inodes_count >= min_inodes and desc.bg_free_blocks_count >= min_blocks)
+                        return (parent_group + k) % ngroups;
+                }
+            }
+            // Every group is busy, take one with at least the average free inodes.
+            for (size_t i = 0; i < ngroups; i++)
+            {
+                if (_group_desc[i].bg_free_inodes_count > 0 and _group_desc[i].bg_free_inodes_count >= avefreei)
+                    return i;
+            }
+            return 0;
+        }
+
+        /**
+         * @brief Pick the group of a new file: its directory's group while that has free inodes and blocks, else the next one that has.
+         */
+        size_t find_group_other(uint32_t parent_inode)
+        {
+            size_t parent_group = (parent_inode - 1) / inodes_per_group;
+            for (size_t k = 0; k < full_group_count; k++)
+            {
+                auto &&desc = _group_desc[(parent_group + k) % full_group_count];
+                if (desc.bg_free_inodes_count > 0 and desc.bg_free_blocks_count > 0)
+                    return (parent_group + k) % full_group_count;
+            }
+            return parent_group;
+        }
+
         /**
          * @brief Find an avaialble inode index, and modify the inode bitmap.
+         * The groups are tried from the one find_group_dir or find_group_other picks on, wrapping around.
          *
+         * @param parent_inode the directory the new inode is created in
+         * @param is_dir the new inode is a directory, counted in bg_used_dirs_count
          * @return inode num , if failed , return 0.
          */
-        size_t ialloc()
+        size_t ialloc(uint32_t parent_inode = ROOT_INODE, bool is_dir = false)
         {
-            for (size_t i = 0; i < full_group_count; i++)
+            size_t group = is_dir ? find_group_dir(parent_inode) : find_group_other(parent_inode);
+            for (size_t k = 0; k < full_group_count; k++)
             {
+                size_t i = (group + k) % full_group_count;
                 // inode num starts from 1
                 size_t start_inode_n = i * inodes_per_group + 1;
+                if (_group_desc[i].bg_free_inodes_count == 0)
+                    continue;
                 auto &&bitmap = get_inode_bitmap(i);
                 uint32_t start = 0;
                 while (start != (uint32_t)-1)
@@ -791,7 +985,10 @@ namespace Ext2m
                             continue;
                         }
                         bitmap.set(start);
-                        write_inode_bitmap(i, bitmap);
+                        bitmap.mark_dirty();
+                        count_free_inodes(i, -1);
+                        if (is_dir)
+                            _group_desc[i].bg_used_dirs_count++;
                         return start + start_inode_n;
                     }
                 }
@@ -812,59 +1009,147 @@ namespace Ext2m
             inode.i_mtime = inode.i_ctime;
             inode.i_atime = inode.i_ctime;
             inode.i_size = 0;
+            if (_superb.s_feature_incompat & EXT4_FEATURE_INCOMPAT_EXTENTS)
+            {
+                uint32_t i_block[EXT2_N_BLOCKS];
+                ext_init(i_block);
+                memcpy(inode.i_block, i_block, sizeof(i_block));
+                inode.i_flags |= EXT4_EXTENTS_FL;
+            }
+        }
+
+        /**
+         * @brief Take the free run [start, start + count) of a group's block bitmap.
+         */
+        void take_run(size_t group_index, bitmap_ref &bitmap, uint32_t start, size_t count, std::vector<uint32_t> &ret)
+        {
+            size_t group_ind = get_group_index(group_index);
+            for (size_t j = start; j < start + count; j++)
+            {
+                ret.push_back(j + group_ind);
+                bitmap.set(j);
+                update_free_word(group_index, bitmap, j);
+            }
+            bitmap.mark_dirty();
+            count_free_blocks(group_index, -(int)count);
         }
 
         /**
          * @brief Get the free block indexes, and modify the block bitmap. Try to find the consecutive blocks in the same group firstly.
+         * The groups are tried from group_id on, wrapping around.
          *
          * @param group_id
          * @param count
+         * @param goal the block the caller would like to get first, usually the one after the file's last block. 0 for no goal.
          * @return std::vector<size_t> , if failed , return empty vector.
          */
-        std::vector<uint32_t> ballocs(size_t group_id, size_t count = 1)
+        std::vector<uint32_t> ballocs(size_t group_id, size_t count = 1, uint32_t goal = 0)
         {
-            // For simplicity, just find any free block in any group
+            assert(count > 0);
             std::vector<uint32_t> ret;
-            for (size_t i = group_id; (i + 1) % full_group_count != group_id; i = (i + 1) % full_group_count)
+            // The goal itself, else the first free run at or after it in its group, so a growing file stays contiguous.
+            // As ext2 does, a run of at least 8 blocks is preferred there, a single hole would break the file again right away.
+            if (goal != 0 and (goal - 1) / blocks_per_group < full_group_count)
             {
-                size_t group_ind = get_group_index(i);
-                auto &&bitmap = get_block_bitmap(i);
-                bool _bitmap_changed = false;
-                uint32_t start = 0;
-                while (start != (uint32_t)-1)
+                group_id = (goal - 1) / blocks_per_group;
+                if (_group_desc[group_id].bg_free_blocks_count >= count)
                 {
-                    start = bitmap.nextBit(start);
+                    auto &&bitmap = get_block_bitmap(group_id);
+                    uint32_t off = (goal - 1) % blocks_per_group;
+                    auto start = bitmap.findRun(count, off);
+                    if (start != off and count < 8)
+                    {
+                        auto run = bitmap.findRun(8, off);
+                        if (run != (uint32_t)-1)
+                            start = run;
+                    }
                     if (start != (uint32_t)-1)
                     {
-                        ret.push_back(start + group_ind);
-                        bitmap.set(start);
-                        _bitmap_changed = true;
-                        count--;
-                        if (count == 0)
-                        {
-                            write_block_bitmap(i, bitmap);
-                            return ret;
-                        }
+                        take_run(group_id, bitmap, start, count, ret);
+                        return ret;
                     }
                 }
-                if (_bitmap_changed)
+            }
+            // The smallest free run that holds all of them, so large runs stay available for large writes.
+            for (size_t k = 0; count > 1 and k < full_group_count; k++)
+            {
+                size_t i = (group_id + k) % full_group_count;
+                if (_group_desc[i].bg_free_blocks_count < count)
+                    continue;
+                auto &&bitmap = get_block_bitmap(i);
+                auto start = bitmap.findRun(count, 0, true);
+                if (start == (uint32_t)-1)
+                    continue;
+                take_run(i, bitmap, start, count, ret);
+                return ret;
+            }
+            // No group has such a run, take free blocks wherever they are.
+            // The summary leads straight to the next 64 blocks with a free one, from group_id on, wrapping around.
+            uint32_t w = group_id * words_per_group;
+            while (count > 0)
+            {
+                w = _free_words->nextBit(w, true);
+                if (w == (uint32_t)-1)
+                    w = _free_words->nextBit(0, true);
+                assert(w != (uint32_t)-1); // the disk is full
+                size_t i = w / words_per_group;
+                size_t group_ind = get_group_index(i);
+                auto &&bitmap = get_block_bitmap(i);
+                uint32_t start = (w % words_per_group) * 64;
+                while (count > 0 and (start = bitmap.nextBit(start)) != (uint32_t)-1)
                 {
-                    write_block_bitmap(i, bitmap);
+                    ret.push_back(start + group_ind);
+                    bitmap.set(start);
+                    update_free_word(i, bitmap, start);
+                    count_free_blocks(i, -1);
+                    count--;
                 }
+                bitmap.mark_dirty();
+                w = (i + 1) % full_group_count * words_per_group;
             }
-            assert(0);
-            return {};
+            return ret;
+        }
+
+        uint32_t balloc(size_t group_id)
+        {
+            return ballocs(group_id, 1).at(0);
         }
 
         /**
-         * @brief Get a free block index, and modify the block bitmap.
+         * @brief Free blocks, and modify the block bitmaps.
+         * The blocks are sorted, every group's bitmap is fetched once and each run of adjacent blocks is cleared at once.
+         * Blocks that are free already are skipped.
          *
-         * @param group_id
-         * @return uint32_t
+         * @param blocks
          */
-        uint32_t balloc(size_t group_id)
+        void bfrees(std::vector<uint32_t> blocks)
         {
-            return ballocs(group_id, 1).at(0);
+            std::sort(blocks.begin(), blocks.end());
+            size_t i = 0;
+            while (i < blocks.size() and blocks[i] == 0)
+                i++;
+            while (i < blocks.size())
+            {
+                auto group_idx = (blocks[i] - 1) / blocks_per_group;
+                assert(group_idx < full_group_count);
+                auto &&bitmap = get_block_bitmap(group_idx);
+                int freed = 0;
+                for (; i < blocks.size() and (blocks[i] - 1) / blocks_per_group == group_idx;)
+                {
+                    uint32_t offset = (blocks[i] - 1) % blocks_per_group;
+                    assert(offset >= 3 + group_desc_block_count + inodes_table_block_count);
+                    uint32_t len = 1;
+                    for (i++; i < blocks.size() and blocks[i] - blocks[i - 1] <= 1 and offset + len < blocks_per_group; i++)
+                        len += blocks[i] - blocks[i - 1];
+                    freed += bitmap.resetRange(offset, len);
+                    for (uint32_t w = offset / 64; w <= (offset + len - 1) / 64; w++)
+                        _free_words->set(group_idx * words_per_group + w);
+                }
+                if (freed == 0)
+                    continue;
+                bitmap.mark_dirty();
+                count_free_blocks(group_idx, freed);
+            }
         }
 
         /**
@@ -876,13 +1161,7 @@ namespace Ext2m
         {
             if (block_idx == 0)
                 return;
-            auto group_idx = (block_idx - 1) / blocks_per_group;
-            auto offset = (block_idx - 1) % blocks_per_group;
-            assert(group_idx < full_group_count);
-            assert(offset >= 3 + group_desc_block_count + inodes_table_block_count);
-            auto &&bitmap = get_block_bitmap(group_idx);
-            bitmap.reset(offset);
-            write_block_bitmap(group_idx, bitmap);
+            bfrees({block_idx});
         }
 
         /**
@@ -895,45 +1174,56 @@ namespace Ext2m
         {
             if (inode_num < _superb.s_first_ino)
                 return;
+            ext2_inode inode;
+            get_inode(inode_num, inode);
+            bool is_dir = (inode.i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR;
+            truncate_blocks(inode_num, 0);
             inode_num--;
             size_t group_index = inode_num / inodes_per_group;
             size_t ind = inode_num % inodes_per_group;
             assert(group_index < full_group_count);
 
-            auto &&all_blocks = get_inode_all_blocks(inode_num);
-            for (auto &&i : all_blocks)
-            {
-                bfree(i);
-            }
             auto &&bm = get_inode_bitmap(group_index);
+            if (not bm.get(ind))
+                return;
             bm.reset(ind);
-            write_inode_bitmap(group_index, bm);
+            bm.mark_dirty();
+            count_free_inodes(group_index, 1);
+            if (is_dir and _group_desc[group_index].bg_used_dirs_count > 0)
+                _group_desc[group_index].bg_used_dirs_count--;
         }
 
         /**
          * @brief Write the inode object to the disk.
+         * It goes to the icache, the inode table is updated on the next sync.
          * ! Caution: Not modify the inode bitmap
          * @param inode_num
          * @param inode
          */
         void write_inode(size_t inode_num, const struct ext2_inode &inode)
         {
-            assert(inode_num >= 1);
-            inode_num--;
-            size_t group_index = inode_num / inodes_per_group;
-            size_t ind = inode_num % inodes_per_group;
-            assert(group_index < full_group_count);
-            auto inode_table_block_ind = get_inode_table_index(group_index);
-
-            //  BLOCK_SIZE / INODE_SIZE; // 8 inodes per block
-            size_t block_index = ind / 8;
-            size_t offset = ind % 8;
+            std::lock_guard<std::mutex> lock(_inode_mtx);
+            auto &&item = icache_get(inode_num, false);
+            item.inode = inode;
+            item.dirty = true;
+            _dirty_inodes.insert(inode_num);
+        }
 
-            _disk.read_block(inode_table_block_ind + block_index, _buf);
-            auto *inode_table = (ext2_inode *)_buf;
-            inode_table[offset] = inode;
+        /**
+         * @brief Keep an inode in the icache while a file is open. Every iget needs an iput.
+         */
+        void iget(uint32_t inode_num)
+        {
+            std::lock_guard<std::mutex> lock(_inode_mtx);
+            icache_get(inode_num).refs++;
+        }
 
-            _disk.write_block(inode_table_block_ind + block_index, _buf);
+        void iput(uint32_t inode_num)
+        {
+            std::lock_guard<std::mutex> lock(_inode_mtx);
+            auto it = _icache.find(inode_num);
+            assert(it != _icache.end() and it->second.refs > 0);
+            it->second.refs--;
         }
 
         void init_entry_block(void *_block, uint32_t inode_num, uint32_t father_inode_num)
@@ -958,55 +1248,380 @@ namespace Ext2m
         }
 
         /**
-         * @brief Add an entry to the inode.
-         *
-         * @param inode_num
-         * @param ent
+         * @brief The ext3 legacy directory hash of a name (DX_HASH_LEGACY_UNSIGNED). Its lowest bit is clear,
+         * a set lowest bit in an index entry marks a run of equal hashes continued from the previous block.
          */
-        void add_entry_to_inode(uint32_t inode_num, const entry &ent)
+        static uint32_t dx_hash(const char *name, size_t len)
         {
-            assert(ent.name.size() <= EXT2_NAME_LEN);
-            auto &&all_blocks = get_inode_all_blocks(inode_num);
-            for (auto &&i : all_blocks)
+            uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+            for (size_t i = 0; i < len; i++)
             {
-                _disk.read_block(i, _buf);
-                entry_block eb(_buf);
-                if (eb.add_entry(ent))
-                {
-                    _disk.write_block(i, _buf);
-                    return;
-                }
+                hash = hash1 + (hash0 ^ ((uint8_t)name[i] * 7152373));
+                if (hash & 0x80000000)
+                    hash -= 0x7fffffff;
+                hash1 = hash0;
+                hash0 = hash;
             }
-            auto n = add_block_to_inode(inode_num);
-            assert(n != (uint32_t)-1);
-            init_entry_block(_buf, inode_num, get_father_inode_num(inode_num));
-            entry_block eb(_buf);
-            bool flag = eb.add_entry(ent);
-            assert(flag);
-            _disk.write_block(n, _buf);
+            return hash0 << 1;
+        }
+
+        static constexpr size_t DX_ROOT_INFO = 24;    // after "." and ".."
+        static constexpr size_t DX_ROOT_ENTRIES = 32; // after the dx_root_info
+        static constexpr size_t DX_NODE_ENTRIES = 8;  // after the empty entry
+        static constexpr uint16_t DX_ROOT_LIMIT = (BLOCK_SIZE - DX_ROOT_ENTRIES) / sizeof(dx_entry);
+        static constexpr uint16_t DX_NODE_LIMIT = (BLOCK_SIZE - DX_NODE_ENTRIES) / sizeof(dx_entry);
+
+        static dx_countlimit *dx_count(dx_entry *entries)
+        {
+            return (dx_countlimit *)entries;
         }
+
         /**
-         * @brief Get the inode object with its inode num.
-         * ! Caution: Not modify the inode bitmap
-         * @param inode_num
-         * @param inode
+         * @brief An index array on the path from the root to a leaf, and the entry followed down.
          */
-        void get_inode(size_t inode_num, struct ext2_inode &inode)
+        struct dx_frame
         {
-            assert(inode_num >= 1);
-            inode_num--;
-            size_t group_index = inode_num / inodes_per_group;
-            size_t ind = inode_num % inodes_per_group;
-            assert(group_index < full_group_count);
-            auto inode_table_block_ind = get_inode_table_index(group_index);
+            BlockRef ref;
+            dx_entry *entries;
+            dx_entry *at;
+        };
 
-            //     BLOCK_SIZE / INODE_SIZE; // 8 inodes per block
-            size_t block_index = ind / 8;
-            size_t offset = ind % 8;
+        /**
+         * @brief Walk the index down to the leaf that may hold hash, one block per level.
+         *
+         * @param frames filled from the root down
+         * @return the depth of the leaf's index array, frames[levels].at points to the leaf
+         */
+        int dx_probe(const ext2_inode &dir, uint32_t hash, dx_frame frames[2])
+        {
+            frames[0].ref = _disk.get(bmap(dir, 0));
+            int levels = ((dx_root_info *)(frames[0].ref.data() + DX_ROOT_INFO))->indirect_levels;
+            assert(levels <= 1);
+            frames[0].entries = (dx_entry *)(frames[0].ref.data() + DX_ROOT_ENTRIES);
+            for (int k = 0;; k++)
+            {
+                auto &&f = frames[k];
+                // the first entry stands for hash 0, find the last one at or below hash
+                int lo = 1, hi = dx_count(f.entries)->count;
+                while (lo < hi)
+                {
+                    int mid = (lo + hi) / 2;
+                    if (f.entries[mid].hash <= hash)
+                        lo = mid + 1;
+                    else
+                        hi = mid;
+                }
+                f.at = f.entries + lo - 1;
+                if (k == levels)
+                    return levels;
+                frames[k + 1].ref = _disk.get(bmap(dir, f.at->block));
+                frames[k + 1].entries = (dx_entry *)(frames[k + 1].ref.data() + DX_NODE_ENTRIES);
+            }
+        }
 
-            _disk.read_block(inode_table_block_ind + block_index, _buf);
-            auto *inode_table = (ext2_inode *)_buf;
-            inode = inode_table[offset];
+        /**
+         * @brief Move to the next leaf if the run of names hashing to hash goes on there.
+         */
+        bool dx_next_leaf(const ext2_inode &dir, uint32_t hash, dx_frame frames[2], int levels)
+        {
+            int k = levels;
+            while (k >= 0 and frames[k].at + 1 == frames[k].entries + dx_count(frames[k].entries)->count)
+                k--;
+            if (k < 0)
+                return false;
+            auto next = frames[k].at[1].hash;
+            if (next != (hash | 1))
+                return false;
+            frames[k].at++;
+            for (; k < levels; k++)
+            {
+                frames[k + 1].ref = _disk.get(bmap(dir, frames[k].at->block));
+                frames[k + 1].entries = (dx_entry *)(frames[k + 1].ref.data() + DX_NODE_ENTRIES);
+                frames[k + 1].at = frames[k + 1].entries;
+            }
+            return true;
+        }
+
+        /**
+         * @brief Append a block to a directory, its number within the directory goes to l.
+         */
+        BlockRef dx_new_block(uint32_t inode_num, uint32_t &l)
+        {
+            ext2_inode dir;
+            get_inode(inode_num, dir);
+            uint32_t last;
+            l = count_blocks_of_inode(dir, last);
+            auto ref = _disk.get(add_block_to_inode(inode_num), false);
+            memset(ref.data(), 0, BLOCK_SIZE);
+            return ref;
+        }
+
+        struct dx_map_entry
+        {
+            uint32_t hash;
+            ext2_dir_entry_2 *ent;
+        };
+
+        /**
+         * @brief Lay out the entries one after the other in block, the last one spans the rest.
+         */
+        static void dx_fill_leaf(uint8_t *block, const dx_map_entry *first, const dx_map_entry *last)
+        {
+            uint8_t *p = block;
+            ext2_dir_entry_2 *tar = nullptr;
+            for (; first != last; first++)
+            {
+                size_t size = roundup(first->ent->name_len + 1 + sizeof(ext2_dir_entry_2), 4);
+                memcpy(p, first->ent, size);
+                tar = (ext2_dir_entry_2 *)p;
+                tar->rec_len = size;
+                p += size;
+            }
+            assert(tar != nullptr);
+            tar->rec_len += block + BLOCK_SIZE - p;
+        }
+
+        /**
+         * @brief Turn a full directory of one block into an indexed one: the entries move to a leaf, the first block keeps "." and ".."
+         * and the root of the index.
+         */
+        void dx_make_indexed(uint32_t inode_num)
+        {
+            ext2_inode dir;
+            get_inode(inode_num, dir);
+            auto root = _disk.get(bmap(dir, 0));
+            std::vector<dx_map_entry> map;
+            uint8_t *p = root.data() + 12;
+            p += ((ext2_dir_entry_2 *)p)->rec_len; // past "." and ".."
+            for (; p != root.data() + BLOCK_SIZE; p += ((ext2_dir_entry_2 *)p)->rec_len)
+                if (((ext2_dir_entry_2 *)p)->inode != 0)
+                    map.push_back({0, (ext2_dir_entry_2 *)p});
+            uint32_t l;
+            auto leaf = dx_new_block(inode_num, l);
+            dx_fill_leaf(leaf.data(), map.data(), map.data() + map.size());
+            leaf.mark_dirty();
+
+            ((ext2_dir_entry_2 *)(root.data() + 12))->rec_len = BLOCK_SIZE - 12;
+            memset(root.data() + DX_ROOT_INFO, 0, BLOCK_SIZE - DX_ROOT_INFO);
+            auto *info = (dx_root_info *)(root.data() + DX_ROOT_INFO);
+            info->hash_version = DX_HASH_LEGACY_UNSIGNED;
+            info->info_length = sizeof(dx_root_info);
+            auto *entries = (dx_entry *)(root.data() + DX_ROOT_ENTRIES);
+            dx_count(entries)->limit = DX_ROOT_LIMIT;
+            dx_count(entries)->count = 1;
+            entries[0].block = l;
+            root.mark_dirty();
+
+            get_inode(inode_num, dir);
+            dir.i_flags |= EXT2_INDEX_FL;
+            write_inode(inode_num, dir);
+        }
+
+        /**
+         * @brief Put (hash, block) into the index array of frame right after the entry followed down. The array has room.
+         */
+        static void dx_insert(dx_frame &frame, uint32_t hash, uint32_t block)
+        {
+            auto *count = dx_count(frame.entries);
+            assert(count->count < count->limit);
+            auto *pos = frame.at + 1;
+            memmove(pos + 1, pos, (frame.entries + count->count - pos) * sizeof(dx_entry));
+            pos->hash = hash;
+            pos->block = block;
+            count->count++;
+            frame.ref.mark_dirty();
+        }
+
+        /**
+         * @brief Make room in the index array above the leaf: a full root moves into a new index node one level down,
+         * a full index node is split in two.
+         *
+         * @return false if the root and the index node are both full, the index has only two levels as in ext3
+         */
+        bool dx_grow_index(uint32_t inode_num, dx_frame frames[2], int &levels)
+        {
+            if (levels == 1 and dx_count(frames[0].entries)->count == DX_ROOT_LIMIT)
+                return false;
+            if (levels == 0)
+            {
+                uint32_t l;
+                auto node = dx_new_block(inode_num, l);
+                ((ext2_dir_entry_2 *)node.data())->rec_len = BLOCK_SIZE;
+                auto *entries = (dx_entry *)(node.data() + DX_NODE_ENTRIES);
+                auto count = dx_count(frames[0].entries)->count;
+                memcpy(entries, frames[0].entries, count * sizeof(dx_entry));
+                dx_count(entries)->limit = DX_NODE_LIMIT;
+                frames[1].at = entries + (frames[0].at - frames[0].entries);
+                frames[1].entries = entries;
+                frames[1].ref = std::move(node);
+                frames[1].ref.mark_dirty();
+
+                ((dx_root_info *)(frames[0].ref.data() + DX_ROOT_INFO))->indirect_levels = levels = 1;
+                dx_count(frames[0].entries)->count = 1;
+                frames[0].entries[0].block = l;
+                frames[0].at = frames[0].entries;
+                frames[0].ref.mark_dirty();
+                if (count < DX_NODE_LIMIT)
+                    return true;
+            }
+            uint32_t l;
+            auto node = dx_new_block(inode_num, l);
+            ((ext2_dir_entry_2 *)node.data())->rec_len = BLOCK_SIZE;
+            auto *entries = (dx_entry *)(node.data() + DX_NODE_ENTRIES);
+            auto *old = frames[1].entries;
+            uint16_t half = dx_count(old)->count / 2, moved = dx_count(old)->count - half;
+            uint32_t hash = old[half].hash;
+            memcpy(entries + 1, old + half + 1, (moved - 1) * sizeof(dx_entry));
+            entries[0].block = old[half].block;
+            dx_count(entries)->limit = DX_NODE_LIMIT;
+            dx_count(entries)->count = moved;
+            dx_count(old)->count = half;
+            node.mark_dirty();
+            frames[1].ref.mark_dirty();
+            dx_insert(frames[0], hash, l);
+            if (frames[1].at >= old + half)
+            {
+                frames[1].at = entries + (frames[1].at - old - half);
+                frames[1].entries = entries;
+                frames[1].ref = std::move(node);
+            }
+            return true;
+        }
+
+        /**
+         * @brief Add an entry to an indexed directory: into the leaf its hash leads to, the leaf is split in two by hash when full.
+         *
+         * @return false if the leaf is full and the index has no room for another one
+         */
+        bool dx_add_entry(uint32_t inode_num, const entry &ent)
+        {
+            uint32_t hash = dx_hash(ent.name.data(), ent.name.size());
+            while (true)
+            {
+                ext2_inode dir;
+                get_inode(inode_num, dir);
+                dx_frame frames[2];
+                int levels = dx_probe(dir, hash, frames);
+                auto leaf = _disk.get(bmap(dir, frames[levels].at->block));
+                entry_block eb(leaf.data());
+                if (eb.add_entry(ent))
+                {
+                    leaf.mark_dirty();
+                    return true;
+                }
+                if (dx_count(frames[levels].entries)->count == dx_count(frames[levels].entries)->limit and
+                    not dx_grow_index(inode_num, frames, levels))
+                    return false;
+
+                // The upper half of the hashes moves to a new leaf, then the entry goes in again.
+                std::vector<dx_map_entry> map;
+                for (uint8_t *p = leaf.data(); p != leaf.data() + BLOCK_SIZE; p += ((ext2_dir_entry_2 *)p)->rec_len)
+                {
+                    auto *e = (ext2_dir_entry_2 *)p;
+                    if (e->inode != 0)
+                        map.push_back({dx_hash(e->name, e->name_len), e});
+                }
+                std::sort(map.begin(), map.end(), [](const dx_map_entry &x, const dx_map_entry &y)
+                          { return x.hash < y.hash; });
+                assert(map.size() >= 2);
+                size_t split = map.size() / 2;
+                uint32_t split_hash = map[split].hash | (map[split].hash == map[split - 1].hash);
+                uint32_t l;
+                auto sibling = dx_new_block(inode_num, l);
+                dx_fill_leaf(sibling.data(), map.data() + split, map.data() + map.size());
+                sibling.mark_dirty();
+                uint8_t kept[BLOCK_SIZE];
+                dx_fill_leaf(kept, map.data(), map.data() + split);
+                memcpy(leaf.data(), kept, BLOCK_SIZE);
+                leaf.mark_dirty();
+                dx_insert(frames[levels], split_hash, l);
+            }
+        }
+
+        /**
+         * @brief The inode of the entry called name in a directory, 0 if there is none.
+         * An indexed directory reads the blocks on the path to one leaf, any other is scanned block by block.
+         */
+        uint32_t lookup_entry(uint32_t inode_num, const std::string &name)
+        {
+            ext2_inode dir;
+            get_inode(inode_num, dir);
+            if ((dir.i_flags & EXT2_INDEX_FL) and name != "." and name != "..")
+            {
+                uint32_t hash = dx_hash(name.data(), name.size());
+                dx_frame frames[2];
+                int levels = dx_probe(dir, hash, frames);
+                do
+                {
+                    auto ref = _disk.get(bmap(dir, frames[levels].at->block));
+                    if (auto found = entry_block(ref.data()).find(name))
+                        return found;
+                } while (dx_next_leaf(dir, hash, frames, levels));
+                return 0;
+            }
+            block_iterator it(*this, dir, 0);
+            for (uint32_t blk; (blk = it.next()) != EXT2M_I_BLOCK_END;)
+            {
+                auto ref = _disk.get(blk);
+                if (auto found = entry_block(ref.data()).find(name))
+                    return found;
+            }
+            return 0;
+        }
+
+        /**
+         * @brief Add an entry to the inode.
+         * A directory of one block is indexed by hash once it is full, if the image has EXT2_FEATURE_COMPAT_DIR_INDEX.
+         *
+         * @param inode_num
+         * @param ent
+         * @return false if the directory can not grow, the disk or its index is full
+         */
+        bool add_entry_to_inode(uint32_t inode_num, const entry &ent)
+        {
+            assert(ent.name.size() <= EXT2_NAME_LEN);
+            ext2_inode dir;
+            get_inode(inode_num, dir);
+            if (dir.i_flags & EXT2_INDEX_FL)
+                return dx_add_entry(inode_num, ent);
+            auto &&all_blocks = get_inode_all_blocks(inode_num);
+            for (auto &&i : all_blocks)
+            {
+                auto ref = _disk.get(i);
+                entry_block eb(ref.data());
+                if (eb.add_entry(ent))
+                {
+                    ref.mark_dirty();
+                    return true;
+                }
+            }
+            if ((_superb.s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) and all_blocks.size() == 1)
+            {
+                dx_make_indexed(inode_num);
+                return dx_add_entry(inode_num, ent);
+            }
+            auto n = add_block_to_inode(inode_num);
+            if (n == (uint32_t)-1)
+                return false;
+            auto father = get_father_inode_num(inode_num);
+            auto ref = _disk.get(n, false);
+            init_entry_block(ref.data(), inode_num, father);
+            entry_block eb(ref.data());
+            bool flag = eb.add_entry(ent);
+            assert(flag);
+            ref.mark_dirty();
+            return true;
+        }
+        /**
+         * @brief Get the inode object with its inode num.
+         * ! Caution: Not modify the inode bitmap
+         * @param inode_num
+         * @param inode
+         */
+        void get_inode(size_t inode_num, struct ext2_inode &inode)
+        {
+            std::lock_guard<std::mutex> lock(_inode_mtx);
+            inode = icache_get(inode_num).inode;
         }
 
         /**
@@ -1014,17 +1629,36 @@ namespace Ext2m
          *
          * @param inode_num the directory inode.
          * @param free_inode the inode to be freed.
+         * @param name the entry's name, it leads to the leaf of an indexed directory.
          */
-        void free_entry_to_inode(uint32_t inode_num, uint32_t free_inode)
+        void free_entry_to_inode(uint32_t inode_num, uint32_t free_inode, const std::string &name)
         {
+            ext2_inode dir;
+            get_inode(inode_num, dir);
+            if (dir.i_flags & EXT2_INDEX_FL)
+            {
+                uint32_t hash = dx_hash(name.data(), name.size());
+                dx_frame frames[2];
+                int levels = dx_probe(dir, hash, frames);
+                do
+                {
+                    auto ref = _disk.get(bmap(dir, frames[levels].at->block));
+                    if (entry_block(ref.data()).free(free_inode))
+                    {
+                        ref.mark_dirty();
+                        return;
+                    }
+                } while (dx_next_leaf(dir, hash, frames, levels));
+                assert(0);
+            }
             auto &&all_blocks = get_inode_all_blocks(inode_num);
             for (auto &&i : all_blocks)
             {
-                _disk.read_block(i, _buf);
-                entry_block eb(_buf);
+                auto ref = _disk.get(i);
+                entry_block eb(ref.data());
                 if (eb.free(free_inode))
                 {
-                    _disk.write_block(i, _buf);
+                    ref.mark_dirty();
                     return;
                 }
             }
@@ -1041,101 +1675,788 @@ namespace Ext2m
         {
             ext2_inode inode;
             get_inode(inode_num, inode);
-            bool flag = true;
             std::vector<uint32_t> indexs;
-            for (int i = 0; i < EXT2_N_BLOCKS; i++)
+            block_iterator it(*this, inode, 0);
+            for (uint32_t blk; (blk = it.next()) != EXT2M_I_BLOCK_END;)
+                indexs.push_back(blk);
+            return indexs;
+        }
+
+        /**
+         * @brief The inode maps its blocks with an extent tree in i_block (EXT4_EXTENTS_FL), not with block pointers.
+         */
+        static bool uses_extents(const ext2_inode &inode)
+        {
+            return (inode.i_flags & EXT4_EXTENTS_FL) != 0;
+        }
+
+        static constexpr uint16_t EXT_ROOT_MAX = (sizeof(ext2_inode::i_block) - sizeof(ext4_extent_header)) / sizeof(ext4_extent);
+        static constexpr uint16_t EXT_BLOCK_MAX = (BLOCK_SIZE - sizeof(ext4_extent_header)) / sizeof(ext4_extent);
+
+        static ext4_extent_header *ext_header(void *node)
+        {
+            return (ext4_extent_header *)node;
+        }
+        static ext4_extent *ext_extents(void *node)
+        {
+            return (ext4_extent *)(ext_header(node) + 1);
+        }
+        static ext4_extent_idx *ext_indexes(void *node)
+        {
+            return (ext4_extent_idx *)(ext_header(node) + 1);
+        }
+
+        /**
+         * @brief An empty extent tree, a leaf in i_block.
+         */
+        static void ext_init(uint32_t *i_block)
+        {
+            memset(i_block, 0, sizeof(ext2_inode::i_block));
+            auto *eh = ext_header(i_block);
+            eh->eh_magic = EXT4_EXT_MAGIC;
+            eh->eh_max = EXT_ROOT_MAX;
+        }
+
+        /**
+         * @brief The entry of a node covering file block l: the last one starting at or before l.
+         * @return -1 if l is before the first entry
+         */
+        static int ext_search(void *node, uint32_t l)
+        {
+            auto *eh = ext_header(node);
+            assert(eh->eh_magic == EXT4_EXT_MAGIC);
+            // extents and indexes both start with the first file block they cover
+            int lo = 0, hi = eh->eh_entries;
+            while (lo < hi)
+            {
+                int mid = (lo + hi) / 2;
+                uint32_t first = eh->eh_depth == 0 ? ext_extents(node)[mid].ee_block : ext_indexes(node)[mid].ei_block;
+                if (first <= l)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            return lo - 1;
+        }
+
+        /**
+         * @brief Find the extent holding file block l, one node read per level.
+         * @return false if l is not mapped
+         */
+        bool ext_find(uint32_t *i_block, uint32_t l, ext4_extent &found)
+        {
+            BlockRef ref;
+            void *node = i_block;
+            while (ext_header(node)->eh_depth > 0)
+            {
+                int i = ext_search(node, l);
+                if (i < 0)
+                    return false;
+                ref = _disk.get(ext_indexes(node)[i].ei_leaf_lo);
+                node = ref.data();
+            }
+            int i = ext_search(node, l);
+            if (i < 0)
+                return false;
+            found = ext_extents(node)[i];
+            return l < found.ee_block + found.ee_len;
+        }
+
+        /**
+         * @brief The last extent of the file, down the rightmost path.
+         * @return false if the file has no block
+         */
+        bool ext_last(uint32_t *i_block, ext4_extent &last)
+        {
+            BlockRef ref;
+            void *node = i_block;
+            while (ext_header(node)->eh_depth > 0)
+            {
+                auto *eh = ext_header(node);
+                assert(eh->eh_entries > 0);
+                ref = _disk.get(ext_indexes(node)[eh->eh_entries - 1].ei_leaf_lo);
+                node = ref.data();
+            }
+            auto *eh = ext_header(node);
+            if (eh->eh_entries == 0)
+                return false;
+            last = ext_extents(node)[eh->eh_entries - 1];
+            return true;
+        }
+
+        /**
+         * @brief A block for a tree node, from the smallest free hole of a group, from group_index on.
+         * The free space right after the file's data is left to the file: when the hole starts there, its last block is taken.
+         *
+         * @param tail the block after the run being mapped
+         */
+        uint32_t ext_node_block(size_t group_index, uint32_t tail)
+        {
+            std::vector<uint32_t> ret;
+            for (size_t k = 0; k < full_group_count; k++)
+            {
+                size_t i = (group_index + k) % full_group_count;
+                if (_group_desc[i].bg_free_blocks_count == 0)
+                    continue;
+                auto &&bitmap = get_block_bitmap(i);
+                uint32_t start = bitmap.findRun(1, 0, true);
+                if (start == (uint32_t)-1)
+                    continue;
+                if (start + get_group_index(i) == tail)
+                {
+                    uint32_t end = bitmap.nextBit(start, true);
+                    start = (end == (uint32_t)-1 ? blocks_per_group : end) - 1;
+                }
+                take_run(i, bitmap, start, 1, ret);
+                return ret.front();
+            }
+            assert(0); // the disk is full
+            return 0;
+        }
+
+        /**
+         * @brief A new tree node holding one entry, for file blocks from l on.
+         * @param depth 0 for a leaf mapping [pblk, pblk + len), else an index pointing to pblk
+         * @param tail the block after the data run being mapped, see ext_node_block
+         */
+        uint32_t ext_new_node(size_t group_index, uint16_t depth, uint32_t l, uint32_t pblk, uint32_t len, uint32_t tail)
+        {
+            uint32_t b = ext_node_block(group_index, tail);
+            auto ref = _disk.get(b, false);
+            memset(ref.data(), 0, BLOCK_SIZE);
+            auto *eh = ext_header(ref.data());
+            eh->eh_magic = EXT4_EXT_MAGIC;
+            eh->eh_max = EXT_BLOCK_MAX;
+            eh->eh_depth = depth;
+            eh->eh_entries = 1;
+            if (depth == 0)
+            {
+                auto &&e = ext_extents(ref.data())[0];
+                e.ee_block = l, e.ee_len = len, e.ee_start_hi = 0, e.ee_start_lo = pblk;
+            }
+            else
+            {
+                auto &&ix = ext_indexes(ref.data())[0];
+                ix.ei_block = l, ix.ei_leaf_lo = pblk, ix.ei_leaf_hi = 0;
+            }
+            ref.mark_dirty();
+            return b;
+        }
+
+        /**
+         * @brief Map the run [pblk, pblk + len) at file block l, past every mapped block. Files only grow at their end,
+         * so only the rightmost path of the tree changes: the last extent grows, or a new one goes into the last leaf.
+         * A full leaf gets a new sibling under the lowest ancestor with room, a full root moves down into a new block.
+         */
+        void ext_append(uint32_t *i_block, uint32_t l, uint32_t pblk, uint32_t len, size_t group_index)
+        {
+            while (len > EXT4_EXT_INIT_MAX_LEN)
+            {
+                ext_append(i_block, l, pblk, EXT4_EXT_INIT_MAX_LEN, group_index);
+                l += EXT4_EXT_INIT_MAX_LEN, pblk += EXT4_EXT_INIT_MAX_LEN, len -= EXT4_EXT_INIT_MAX_LEN;
+            }
+            std::vector<void *> path{i_block};
+            std::vector<BlockRef> refs(1); // refs[k] holds path[k], the root is in the inode
+            while (ext_header(path.back())->eh_depth > 0)
             {
-                auto n = inode.i_block[i];
-                if (i < EXT2_DIRECT_BLOCKS) // direct access block
+                auto *eh = ext_header(path.back());
+                refs.push_back(_disk.get(ext_indexes(path.back())[eh->eh_entries - 1].ei_leaf_lo));
+                path.push_back(refs.back().data());
+            }
+            auto *leaf = ext_header(path.back());
+            auto *ex = ext_extents(path.back());
+            if (leaf->eh_entries > 0)
+            {
+                auto &&e = ex[leaf->eh_entries - 1];
+                assert(e.ee_block + e.ee_len <= l);
+                if (e.ee_block + e.ee_len == l and e.ee_start_lo + e.ee_len == pblk and e.ee_len + len <= EXT4_EXT_INIT_MAX_LEN)
                 {
-                    flag &= __get_inode_all_blocks__(n, 0, indexs);
+                    e.ee_len += len;
+                    if (refs.back().data() != nullptr)
+                        refs.back().mark_dirty();
+                    return;
                 }
-                else if (i == EXT2_INDIRECT_BLOCK) // the first indirect block
+            }
+            if (leaf->eh_entries < leaf->eh_max)
+            {
+                auto &&e = ex[leaf->eh_entries++];
+                e.ee_block = l, e.ee_len = len, e.ee_start_hi = 0, e.ee_start_lo = pblk;
+                if (refs.back().data() != nullptr)
+                    refs.back().mark_dirty();
+                return;
+            }
+            int k = (int)path.size() - 2;
+            while (k >= 0 and ext_header(path[k])->eh_entries == ext_header(path[k])->eh_max)
+                k--;
+            if (k < 0)
+            {
+                // The root is full: it moves into a block of its own and becomes an index one level higher.
+                auto *root = ext_header(i_block);
+                uint32_t first = root->eh_depth == 0 ? ext_extents(i_block)[0].ee_block : ext_indexes(i_block)[0].ei_block;
+                uint32_t b = ext_node_block(group_index, pblk + len);
                 {
-                    flag &= __get_inode_all_blocks__(n, 1, indexs);
+                    auto ref = _disk.get(b, false);
+                    memset(ref.data(), 0, BLOCK_SIZE);
+                    memcpy(ref.data(), i_block, sizeof(ext2_inode::i_block));
+                    ext_header(ref.data())->eh_max = EXT_BLOCK_MAX;
+                    ref.mark_dirty();
                 }
-                else if (i == EXT2_DOUBLY_INDIRECT_BLOCK) // the second indirect block
+                root->eh_depth++;
+                root->eh_entries = 1;
+                auto &&ix = ext_indexes(i_block)[0];
+                ix.ei_block = first, ix.ei_leaf_lo = b, ix.ei_leaf_hi = 0;
+                refs.clear();
+                ext_append(i_block, l, pblk, len, group_index);
+                return;
+            }
+            // A new chain from path[k] down to a leaf holding the run.
+            uint32_t child = ext_new_node(group_index, 0, l, pblk, len, pblk + len);
+            for (uint16_t d = 1; d < ext_header(path[k])->eh_depth; d++)
+                child = ext_new_node(group_index, d, l, child, 0, pblk + len);
+            auto *eh = ext_header(path[k]);
+            auto &&ix = ext_indexes(path[k])[eh->eh_entries++];
+            ix.ei_block = l, ix.ei_leaf_lo = child, ix.ei_leaf_hi = 0;
+            if (refs[k].data() != nullptr)
+                refs[k].mark_dirty();
+        }
+
+        /**
+         * @brief Unmap the file blocks from keep on in the subtree of node, in place. Only the rightmost entries are
+         * visited: they are dropped, or the one holding keep is shortened. A child left empty is freed with its entry.
+         *
+         * @param freed gets the data blocks and tree nodes to free
+         * @return true if node changed
+         */
+        bool ext_trim(void *node, uint32_t keep, std::vector<uint32_t> &freed)
+        {
+            auto *eh = ext_header(node);
+            bool changed = false;
+            if (eh->eh_depth == 0)
+            {
+                auto *ex = ext_extents(node);
+                while (eh->eh_entries > 0)
                 {
-                    flag &= __get_inode_all_blocks__(n, 2, indexs);
+                    auto &&e = ex[eh->eh_entries - 1];
+                    if (e.ee_block + e.ee_len <= keep)
+                        break;
+                    uint32_t kept = e.ee_block >= keep ? 0 : keep - e.ee_block;
+                    for (uint32_t i = kept; i < e.ee_len; i++)
+                        freed.push_back(e.ee_start_lo + i);
+                    changed = true;
+                    if (kept > 0)
+                    {
+                        e.ee_len = kept;
+                        break;
+                    }
+                    eh->eh_entries--;
                 }
-                else if (i == EXT2_TRIPLY_INDIRECT_BLOCK) // the third indirect block
+                return changed;
+            }
+            auto *ix = ext_indexes(node);
+            while (eh->eh_entries > 0)
+            {
+                uint32_t child = ix[eh->eh_entries - 1].ei_leaf_lo;
+                auto ref = _disk.get(child);
+                bool child_changed = ext_trim(ref.data(), keep, freed);
+                if (ext_header(ref.data())->eh_entries > 0)
                 {
-                    flag &= __get_inode_all_blocks__(n, 3, indexs);
+                    // The children on its left map only blocks before keep.
+                    if (child_changed)
+                        ref.mark_dirty();
+                    break;
                 }
-                else
+                freed.push_back(child);
+                eh->eh_entries--;
+                changed = true;
+            }
+            return changed;
+        }
+
+        /**
+         * @brief Unmap the file blocks from keep on, see ext_trim. Nothing is allocated, a truncate works on a full disk.
+         *
+         * @param freed gets the data blocks and tree nodes to free
+         */
+        void ext_truncate(uint32_t *i_block, uint32_t keep, std::vector<uint32_t> &freed)
+        {
+            ext_trim(i_block, keep, freed);
+            // An index root with no child left is a leaf again.
+            if (ext_header(i_block)->eh_entries == 0)
+                ext_init(i_block);
+        }
+
+        /**
+         * @brief Where the file block l is mapped.
+         *
+         * @param l file block number
+         * @param off off[0] is the slot in i_block, off[1..level] the entries in the index blocks, top down
+         * @return level 0 for direct access block, 1 to 3 for the first to third indirect block
+         */
+        static int block_path(uint32_t l, uint32_t off[4])
+        {
+            constexpr uint32_t P = BLOCK_SIZE / sizeof(uint32_t);
+            if (l < EXT2_DIRECT_BLOCKS)
+            {
+                off[0] = l;
+                return 0;
+            }
+            l -= EXT2_DIRECT_BLOCKS;
+            if (l < P)
+            {
+                off[0] = EXT2_INDIRECT_BLOCK, off[1] = l;
+                return 1;
+            }
+            l -= P;
+            if (l < P * P)
+            {
+                off[0] = EXT2_DOUBLY_INDIRECT_BLOCK, off[1] = l / P, off[2] = l % P;
+                return 2;
+            }
+            l -= P * P;
+            assert(l < P * P * P);
+            off[0] = EXT2_TRIPLY_INDIRECT_BLOCK, off[1] = l / P / P, off[2] = l / P % P, off[3] = l % P;
+            return 3;
+        }
+
+        /**
+         * @brief Number of data blocks of a file, following the last pointer at every level.
+         *
+         * @param last set to the block allocated last to the file, data or index one. 0 if the file has no block.
+         */
+        uint32_t count_blocks_of_inode(const ext2_inode &inode, uint32_t &last)
+        {
+            constexpr uint32_t P = BLOCK_SIZE / sizeof(uint32_t);
+            last = EXT2M_I_BLOCK_END;
+            if (uses_extents(inode))
+            {
+                uint32_t i_block[EXT2_N_BLOCKS];
+                memcpy(i_block, inode.i_block, sizeof(i_block));
+                ext4_extent e;
+                if (not ext_last(i_block, e))
+                    return 0;
+                last = e.ee_start_lo + e.ee_len - 1;
+                return e.ee_block + e.ee_len;
+            }
+            int i = EXT2_N_BLOCKS - 1;
+            while (i >= 0 and inode.i_block[i] == EXT2M_I_BLOCK_END)
+                i--;
+            if (i < EXT2_DIRECT_BLOCKS)
+            {
+                last = i >= 0 ? inode.i_block[i] : EXT2M_I_BLOCK_END;
+                return i + 1;
+            }
+            int level = i - EXT2_INDIRECT_BLOCK + 1;
+            uint32_t base = EXT2_DIRECT_BLOCKS + (level >= 2 ? P : 0) + (level >= 3 ? P * P : 0);
+            uint32_t blk = inode.i_block[i], idx = 0;
+            for (int d = 1; d <= level; d++)
+            {
+                auto ref = _disk.get(blk);
+                const uint32_t *entries = ref.as<uint32_t>();
+                int j = P - 1;
+                while (j >= 0 and entries[j] == EXT2M_I_BLOCK_END)
+                    j--;
+                if (j < 0) // an empty index block
+                {
+                    last = blk;
+                    for (; d <= level; d++)
+                        idx *= P;
+                    return base + idx;
+                }
+                idx = idx * P + j;
+                blk = entries[j];
+            }
+            last = blk;
+            return base + idx + 1;
+        }
+
+        /**
+         * @brief Walks the blocks of a file in order from a file block on.
+         * The index blocks on the current path stay pinned, the next block only costs a lookup when the path changes.
+         */
+        class block_iterator
+        {
+            Ext2m &_fs;
+            uint32_t _i_block[EXT2_N_BLOCKS];
+            uint32_t _l; // file block next() maps
+            BlockRef _refs[4]; // the index blocks on the path, by depth
+            uint32_t _held[4] = {0, 0, 0, 0};
+            bool _extents;
+            ext4_extent _cur = {0, 0, 0, 0}; // the extent found last
+
+        public:
+            block_iterator(Ext2m &fs, const ext2_inode &inode, uint32_t first) : _fs(fs), _l(first), _extents(uses_extents(inode))
+            {
+                memcpy(_i_block, inode.i_block, sizeof(_i_block));
+            }
+
+            /**
+             * @return the block of the next file block, 0 past the end of the file
+             */
+            uint32_t next()
+            {
+                if (_extents)
                 {
-                    assert(0);
+                    uint32_t l = _l++;
+                    if (l - _cur.ee_block >= _cur.ee_len and not _fs.ext_find(_i_block, l, _cur))
+                    {
+                        _cur.ee_len = 0;
+                        return EXT2M_I_BLOCK_END;
+                    }
+                    return _cur.ee_start_lo + (l - _cur.ee_block);
+                }
+                uint32_t off[4];
+                int level = block_path(_l++, off);
+                uint32_t blk = _i_block[off[0]];
+                for (int d = 1; d <= level and blk != EXT2M_I_BLOCK_END; d++)
+                {
+                    if (_held[d] != blk)
+                    {
+                        _refs[d] = _fs._disk.get(blk);
+                        _held[d] = blk;
+                    }
+                    blk = _refs[d].as<uint32_t>()[off[d]];
                 }
-                if (not flag)
+                return blk;
+            }
+        };
+
+        /**
+         * @brief The block of the file block l, reading only the index blocks on its path.
+         *
+         * @return 0 past the end of the file
+         */
+        uint32_t bmap(const ext2_inode &inode, uint32_t l)
+        {
+            return block_iterator(*this, inode, l).next();
+        }
+
+        /**
+         * @brief The blocks of the file blocks [first, first + count), fewer if the file ends before.
+         */
+        std::vector<uint32_t> bmap_range(const ext2_inode &inode, uint32_t first, uint32_t count)
+        {
+            std::vector<uint32_t> ret;
+            ret.reserve(count);
+            block_iterator it(*this, inode, first);
+            for (uint32_t i = 0; i < count; i++)
+            {
+                auto blk = it.next();
+                if (blk == EXT2M_I_BLOCK_END)
                     break;
+                ret.push_back(blk);
             }
-            return indexs;
+            return ret;
         }
 
         /**
-         * @brief Add a block to an inode.
+         * @brief Find a run of n free blocks for a new window that no other window overlaps.
+         * The goal's group is searched from the goal on, then the groups from group_id on, wrapping around.
+         *
+         * @return the first block of the run, 0 if there is none
+         */
+        uint32_t find_window(size_t group_id, uint32_t goal, size_t n)
+        {
+            uint32_t off = 0;
+            if (goal != 0 and (goal - 1) / blocks_per_group < full_group_count)
+            {
+                group_id = (goal - 1) / blocks_per_group;
+                off = (goal - 1) % blocks_per_group;
+            }
+            for (size_t k = 0; k < full_group_count; k++, off = 0)
+            {
+                size_t i = (group_id + k) % full_group_count;
+                if (_group_desc[i].bg_free_blocks_count < n)
+                    continue;
+                auto &&bitmap = get_block_bitmap(i);
+                size_t group_ind = get_group_index(i);
+                uint32_t start;
+                while ((start = bitmap.findRun(n, off)) != (uint32_t)-1)
+                {
+                    uint32_t first = start + group_ind;
+                    // The windows are disjoint, only the first one ending after the run can overlap it.
+                    auto other = _windows.upper_bound(first);
+                    if (other == _windows.end() or _reservations[other->second].next >= first + n)
+                        return first;
+                    off = other->first - group_ind;
+                }
+            }
+            return 0;
+        }
+
+        /**
+         * @brief Get count new blocks for an inode, from its reservation when reserve is set.
+         * A used up reservation is replaced by a twice larger window (RESERVE_WINDOW_INIT up to RESERVE_WINDOW_MAX blocks) at the goal,
+         * or one as large as the rest of the request, so files appended to at the same time do not interleave their blocks.
+         * Blocks of the window that were taken meanwhile are skipped.
+         */
+        std::vector<uint32_t> new_blocks(uint32_t inode_num, size_t group_index, uint32_t goal, size_t count, bool reserve)
+        {
+            if (not reserve)
+                return ballocs(group_index, count, goal);
+            std::vector<uint32_t> ret;
+            auto &&rsv = _reservations[inode_num];
+            while (ret.size() < count)
+            {
+                if (rsv.next == rsv.end)
+                {
+                    rsv.window = rsv.window == 0 ? RESERVE_WINDOW_INIT : std::min<uint32_t>(2 * rsv.window, RESERVE_WINDOW_MAX);
+                    size_t need = count - ret.size();
+                    size_t n = std::max<size_t>(need, std::min<size_t>(rsv.window, _superb.s_free_blocks_count));
+                    uint32_t next_goal = ret.empty() ? goal : ret.back() + 1;
+                    uint32_t first = find_window(group_index, next_goal, n);
+                    if (first == 0)
+                    {
+                        // Too fragmented for a window, the rest goes wherever there are free blocks.
+                        _reservations.erase(inode_num);
+                        auto &&rest = ballocs(group_index, need, next_goal);
+                        ret.insert(ret.end(), rest.begin(), rest.end());
+                        return ret;
+                    }
+                    rsv.next = first;
+                    rsv.end = first + n;
+                    _windows[rsv.end] = inode_num;
+                }
+                size_t group_id = (rsv.next - 1) / blocks_per_group;
+                size_t group_ind = get_group_index(group_id);
+                auto &&bitmap = get_block_bitmap(group_id);
+                int taken = 0;
+                for (; rsv.next < rsv.end and ret.size() < count; rsv.next++)
+                {
+                    uint32_t bit = rsv.next - group_ind;
+                    if (bitmap.get(bit))
+                        continue;
+                    bitmap.set(bit);
+                    update_free_word(group_id, bitmap, bit);
+                    ret.push_back(rsv.next);
+                    taken++;
+                }
+                if (rsv.next == rsv.end)
+                    _windows.erase(rsv.end);
+                if (taken == 0)
+                    continue;
+                bitmap.mark_dirty();
+                count_free_blocks(group_id, -taken);
+            }
+            return ret;
+        }
+
+        /**
+         * @brief Append n blocks to an inode.
+         * The blocks, with the index blocks they need, are allocated together, right after the file's last block if possible,
+         * so sequential writes get sequential blocks. The first block of a file goes near its inode table.
+         * The inode is read and written once and every index block is fetched once.
          *
          * @param inode_num
-         * @return uint32_t
+         * @param n
+         * @param reserve take the blocks from the inode's reservation, for files being written. See discard_reservation.
+         * @return std::vector<uint32_t> the new data blocks, in file order.
          */
-        uint32_t add_block_to_inode(size_t inode_num)
+        std::vector<uint32_t> add_blocks_to_inode(size_t inode_num, size_t n, bool reserve = false)
         {
-            size_t group_index = inode_num / inodes_per_group;
+            size_t group_index = (inode_num - 1) / inodes_per_group;
 
             ext2_inode inode;
             get_inode(inode_num, inode);
 
-            // direct access
-            for (int i = 0; i < EXT2_DIRECT_BLOCKS; i++)
+            uint32_t goal;
+            uint32_t first = count_blocks_of_inode(inode, goal);
+            goal = goal != EXT2M_I_BLOCK_END ? goal + 1 : get_data_table_index(group_index);
+
+            if (uses_extents(inode))
             {
-                auto nb = inode.i_block[i];
-                if (nb == EXT2M_I_BLOCK_END)
+                auto &&blocks = new_blocks(inode_num, group_index, goal, n, reserve);
+                uint32_t i_block[EXT2_N_BLOCKS];
+                memcpy(i_block, inode.i_block, sizeof(i_block));
+                for (size_t i = 0, j; i < blocks.size(); i = j)
                 {
-                    auto pos = ballocs(group_index, 1).front();
-                    inode.i_block[i] = pos;
-                    write_inode(inode_num, inode);
-                    return pos;
+                    for (j = i + 1; j < blocks.size() and blocks[j] == blocks[j - 1] + 1;)
+                        j++;
+                    ext_append(i_block, first + i, blocks[i], j - i, group_index);
                 }
+                memcpy(inode.i_block, i_block, sizeof(i_block));
+                write_inode(inode_num, inode);
+                return blocks;
             }
 
-            // first indirect access
-            if (inode.i_block[EXT2_INDIRECT_BLOCK] == EXT2M_I_BLOCK_END)
+            // An index block is allocated where the path of a new block has none, it is laid out right before that block.
+            // The paths are followed as they are on disk, an index block left empty by a truncate is used again.
+            uint32_t off[4];
+            size_t total = n;
             {
-                auto pos = ballocs(group_index, 1).front();
-                inode.i_block[EXT2_INDIRECT_BLOCK] = pos;
-                write_inode(inode_num, inode);
-
-                memset(_buf, 0, BLOCK_SIZE);
-                _disk.write_block(pos, _buf);
+                uint32_t path[4] = {0, 0, 0, 0}; // index block on the path at each depth, EXT2M_I_BLOCK_END if it is to be allocated
+                for (uint32_t l = first; l < first + n; l++)
+                {
+                    int level = block_path(l, off);
+                    // The index blocks from depth d on change at l, the ones above are those of l - 1.
+                    int d = level + 1;
+                    while (d > 1 and (off[d - 1] == 0 or l == first))
+                        d--;
+                    for (; d <= level; d++)
+                    {
+                        if (d == 1)
+                            path[d] = inode.i_block[off[0]];
+                        else if (path[d - 1] == EXT2M_I_BLOCK_END)
+                            path[d] = EXT2M_I_BLOCK_END;
+                        else
+                            path[d] = _disk.get(path[d - 1]).as<uint32_t>()[off[d - 1]];
+                        if (path[d] == EXT2M_I_BLOCK_END)
+                            total++;
+                    }
+                }
             }
-            ssize_t ret = __add_block_to_inode__(inode.i_block[EXT2_INDIRECT_BLOCK], 1, group_index);
-            if (ret != -1)
-                return ret;
+            auto &&blocks = new_blocks(inode_num, group_index, goal, total, reserve);
+            auto next = blocks.begin();
 
-            // second indirect access
-            if (inode.i_block[EXT2_DOUBLY_INDIRECT_BLOCK] == EXT2M_I_BLOCK_END)
+            std::vector<uint32_t> ret;
+            ret.reserve(n);
+            uint32_t i_block[EXT2_N_BLOCKS]; // ext2_inode is packed, no pointer into it
+            memcpy(i_block, inode.i_block, sizeof(i_block));
+            BlockRef refs[4]; // the index blocks on the path of the current block, by depth
+            uint32_t held[4] = {0, 0, 0, 0};
+            auto put = [&](int d)
             {
-                auto pos = ballocs(group_index, 1).front();
-                inode.i_block[EXT2_DOUBLY_INDIRECT_BLOCK] = pos;
-                write_inode(inode_num, inode);
-                memset(_buf, 0, BLOCK_SIZE);
-                _disk.write_block(pos, _buf);
+                if (refs[d].data() != nullptr)
+                    refs[d].mark_dirty();
+            };
+            for (uint32_t l = first; l < first + n; l++)
+            {
+                int level = block_path(l, off);
+                uint32_t *slot = &i_block[off[0]];
+                for (int d = 1; d <= level; d++)
+                {
+                    if (*slot == EXT2M_I_BLOCK_END)
+                    {
+                        assert(next != blocks.end());
+                        *slot = *next++;
+                        put(d);
+                        refs[d] = _disk.get(*slot, false);
+                        memset(refs[d].data(), 0, BLOCK_SIZE);
+                        held[d] = *slot;
+                    }
+                    else if (held[d] != *slot)
+                    {
+                        put(d);
+                        refs[d] = _disk.get(*slot);
+                        held[d] = *slot;
+                    }
+                    slot = refs[d].as<uint32_t>() + off[d];
+                }
+                assert(next != blocks.end() and *slot == EXT2M_I_BLOCK_END);
+                *slot = *next++;
+                ret.push_back(*slot);
             }
-            ret = __add_block_to_inode__(inode.i_block[EXT2_DOUBLY_INDIRECT_BLOCK], 2, group_index);
-            if (ret != -1)
-                return ret;
+            assert(next == blocks.end());
+            for (int d = 1; d < 4; d++)
+                put(d);
+            memcpy(inode.i_block, i_block, sizeof(i_block));
+            write_inode(inode_num, inode);
+            return ret;
+        }
+
+        /**
+         * @brief Free the blocks of an inode from file block keep on, with the index blocks that no longer map anything.
+         * The inode is read and written once, all the blocks are freed by one bfrees.
+         *
+         * @param inode_num
+         * @param keep number of blocks left to the file
+         */
+        void truncate_blocks(size_t inode_num, uint32_t keep)
+        {
+            discard_reservation(inode_num); // the next block goes after the new end of the file, ifree drops it for good
+            ext2_inode inode;
+            get_inode(inode_num, inode);
+            uint32_t last;
+            uint32_t count = count_blocks_of_inode(inode, last);
+            if (keep >= count)
+                return;
 
-            // third indirect access
-            if (inode.i_block[EXT2_TRIPLY_INDIRECT_BLOCK] == EXT2M_I_BLOCK_END)
+            uint32_t i_block[EXT2_N_BLOCKS]; // ext2_inode is packed, no pointer into it
+            memcpy(i_block, inode.i_block, sizeof(i_block));
+            std::vector<uint32_t> freed;
+            if (uses_extents(inode))
             {
-                auto pos = ballocs(group_index, 1).front();
-                inode.i_block[EXT2_TRIPLY_INDIRECT_BLOCK] = pos;
+                ext_truncate(i_block, keep, freed);
+                bfrees(freed);
+                memcpy(inode.i_block, i_block, sizeof(i_block));
                 write_inode(inode_num, inode);
-                memset(_buf, 0, BLOCK_SIZE);
-                _disk.write_block(pos, _buf);
+                return;
             }
-            ret = __add_block_to_inode__(inode.i_block[EXT2_TRIPLY_INDIRECT_BLOCK], 3, group_index);
-            return ret;
+            BlockRef refs[4]; // the index blocks on the path of the current block, by depth
+            uint32_t held[4] = {0, 0, 0, 0};
+            uint32_t *slots[4]; // the entry pointing to the index block at each depth
+            uint32_t off[4];
+            auto put = [&](int d)
+            {
+                if (held[d] != 0)
+                    refs[d].mark_dirty();
+                refs[d].release();
+                held[d] = 0;
+            };
+            // Backwards, so an index block is empty as soon as the first block it maps is gone.
+            for (uint32_t l = count; l-- > keep;)
+            {
+                int level = block_path(l, off);
+                uint32_t *slot = &i_block[off[0]];
+                int d = 1;
+                for (; d <= level and *slot != EXT2M_I_BLOCK_END; d++)
+                {
+                    slots[d] = slot;
+                    if (held[d] != *slot)
+                    {
+                        put(d);
+                        refs[d] = _disk.get(*slot);
+                        held[d] = *slot;
+                    }
+                    slot = refs[d].as<uint32_t>() + off[d];
+                }
+                if (d <= level) // no index block there
+                    continue;
+                if (*slot != EXT2M_I_BLOCK_END)
+                {
+                    freed.push_back(*slot);
+                    *slot = EXT2M_I_BLOCK_END;
+                }
+                for (d = level; d >= 1 and off[d] == 0; d--)
+                {
+                    freed.push_back(held[d]);
+                    *slots[d] = EXT2M_I_BLOCK_END;
+                    refs[d].release();
+                    held[d] = 0;
+                }
+            }
+            for (int d = 1; d < 4; d++)
+                put(d);
+            bfrees(freed);
+            memcpy(inode.i_block, i_block, sizeof(i_block));
+            write_inode(inode_num, inode);
+        }
+
+        /**
+         * @brief Add a block to an inode.
+         *
+         * @param inode_num
+         * @param reserve see add_blocks_to_inode
+         * @return uint32_t
+         */
+        uint32_t add_block_to_inode(size_t inode_num, bool reserve = false)
+        {
+            return add_blocks_to_inode(inode_num, 1, reserve).front();
+        }
+
+        /**
+         * @brief Drop the window of an inode, when the file is closed, truncated or freed. Its blocks were never taken from the bitmap.
+         *
+         * @param inode_num
+         */
+        void discard_reservation(uint32_t inode_num)
+        {
+            auto it = _reservations.find(inode_num);
+            if (it == _reservations.end())
+                return;
+            auto w = _windows.find(it->second.end);
+            if (w != _windows.end() and w->second == inode_num)
+                _windows.erase(w);
+            _reservations.erase(it);
         }
     };
 
@@ -7,31 +7,64 @@
 
 using namespace std;
 
-int main(void)
+// Runs on a freshly formatted image of the given layout, then again after remounting it.
+static void scenario(const Ext2m::format_options &fmt)
 {
-    Disk disk("disk.img");
+    remove("scenario.img");
+    {
+        Disk disk("scenario.img");
+        Cache cache(disk, 8 * BLOCK_SIZE);
+        Ext2m::Ext2m ext2fs(cache, fmt);
+        VFS vfs(ext2fs);
+
+        cout << vfs.ls("/") << endl;
+        vfs.mkdir("/home");
+        vfs.mkdir("/home/delta");
+        cout << vfs.ls("/") << endl;
+        cout << vfs.ls("/home") << endl;
+
+        vfs.create("/home/delta/Readme.txt");
+        int fd = vfs.open("/home/delta/Readme.txt", O_WRONLY);
+        vfs.write(fd, "Hello World", 11);
+        vfs.close(fd);
+        cout << vfs.ls("/home/delta") << endl;
+
+        // enough entries to take the directory past one block
+        vfs.mkdir("/home/delta/many");
+        for (int i = 0; i < 500; i++)
+            assert(vfs.create(("/home/delta/many/file" + to_string(i)).c_str()) == 0);
+        for (int i = 0; i < 500; i += 2)
+            assert(vfs.unlink(("/home/delta/many/file" + to_string(i)).c_str()) == 0);
+    }
+
+    Disk disk("scenario.img");
     Cache cache(disk, 8 * BLOCK_SIZE);
     Ext2m::Ext2m ext2fs(cache);
     VFS vfs(ext2fs);
 
-    cout << vfs.ls("/") << endl;
-    vfs.mkdir("/home");
-    vfs.mkdir("/home/delta");
-    cout << vfs.ls("/") << endl;
-    cout << vfs.ls("/home") << endl;
-
-    vfs.create("/home/delta/Readme.txt");
-    int fd = vfs.open("/home/delta/Readme.txt", O_WRONLY);
-    vfs.write(fd, "Hello World", 11);
-    vfs.close(fd);
-    cout << vfs.ls("/home/delta") << endl;
-
     char buf[512];
     memset(buf, 0, sizeof(buf));
-    fd = vfs.open("/home/delta/Readme.txt", O_RDONLY);
+    int fd = vfs.open("/home/delta/Readme.txt", O_RDONLY);
     vfs.read(fd, buf, 512);
     cout << buf << endl;
     vfs.close(fd);
 
+    for (int i = 0; i < 500; i++)
+        assert(vfs.exists(("/home/delta/many/file" + to_string(i)).c_str()) == (i % 2 ? 0 : -1));
+}
+
+int main(void)
+{
+    for (bool extents : {false, true})
+        for (bool dir_index : {false, true})
+        {
+            Ext2m::format_options fmt;
+            fmt.extents = extents;
+            fmt.dir_index = dir_index;
+            cout << "extents " << extents << ", dir_index " << dir_index << endl;
+            scenario(fmt);
+        }
+    remove("scenario.img");
+
     return 0;
 }
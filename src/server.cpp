@@ -2,13 +2,14 @@
 #include <memory>
 #include <string>
 #include <thread>
+#include <unistd.h>
 #include "extern/Socket.h"
 #include "extern/TCPServer.h"
 #include "shell.hpp"
 #include "user.hpp"
 #include "util.hpp"
 #include "vfs.hpp"
-#define helpMessage "Command:\npwd:                    Show working directory\ncd(chdir) [dirname]:    Switch current working directory\nls [dirname]:           Display the contents of the specified working directory\ncat(read) fileName:     Connect files and print to standard output devices\nmkdir dirName:          Create directory\nrm(remove) name...:     Delete a file or directory\ntouch(create) [name]:   Create a new file\nwrite message fileName: File write information\nrmdir dirName:          Delete empty directory\nmv source dest:         Rename or move a file or directory to another location\n"
+#define helpMessage "Command:\npwd:                    Show working directory\ncd(chdir) [dirname]:    Switch current working directory\nls [dirname]:           Display the contents of the specified working directory\ncat(read) fileName:     Connect files and print to standard output devices\nmkdir dirName:          Create directory\nrm(remove) name...:     Delete a file or directory\ntouch(create) [name]:   Create a new file\nwrite message fileName: File write information\nrmdir dirName:          Delete empty directory\nmv source dest:         Rename or move a file or directory to another location\ndf:                     Show free blocks and inodes of each block group\n"
 using namespace std;
 
 constexpr int COMMAND_LEN = 128;
@@ -23,7 +24,7 @@ void debug(const char* msg) {
     printf("[%s]: %s\n", output, msg);
 }
 
-mutex mtx;
+shared_timed_mutex mtx;
 VFS* _vfsp;
 
 void handler(CTCPServer& server, ASocket::Socket socket) {
@@ -98,6 +99,9 @@ void handler(CTCPServer& server, ASocket::Socket socket) {
             else
                 ret = sh.ls(comarr[1]);
             send_msg(ret);
+        } else if (com == "df") {
+            // Report free blocks and inodes
+            send_msg(sh.df());
         } else if (com == "cat" or com == "read") {
             // Connect files and print to standard output devices
             if (comarr.size() < 2) {
@@ -172,30 +176,95 @@ void handler(CTCPServer& server, ASocket::Socket socket) {
     }
 }
 
+static void usage(const char* prog) {
+    printf("Usage: %s [-b posix|mmap|stdio] [-p lru|2q] [-i interval_ms] [-e expire_ms] [-r dirty_ratio] [-x] [-d] [port]\n", prog);
+    printf("  -b  disk backend (default posix)\n");
+    printf("  -p  block cache replacement policy (default 2q)\n");
+    printf("  -i  how often the cache flusher wakes up (default 1000)\n");
+    printf("  -e  age after which a dirty block is written back (default 5000)\n");
+    printf("  -r  percent of the cache dirty that triggers a full writeback (default 20)\n");
+    printf("  -x  map files by extents when a new image is formatted\n");
+    printf("  -d  index large directories by hash when a new image is formatted\n");
+}
+
 int main(int argc, char** argv) {
     printf("Server start\n");
 
     setbuf(stdout, 0);
 
-    Disk disk("disk.img");
-    Cache cache(disk, 8 * BLOCK_SIZE);
-    Ext2m::Ext2m ext2fs(cache);
+    writeback_options wb;
+    CachePolicy policy = CachePolicy::TWO_Q;
+    DiskBackend backend = DiskBackend::POSIX;
+    Ext2m::format_options fmt;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:p:i:e:r:xdh")) != -1) {
+        switch (opt) {
+            case 'b':
+                if (strcmp(optarg, "posix") == 0) {
+                    backend = DiskBackend::POSIX;
+                } else if (strcmp(optarg, "mmap") == 0) {
+                    backend = DiskBackend::MMAP;
+                } else if (strcmp(optarg, "stdio") == 0) {
+                    backend = DiskBackend::STDIO;
+                } else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'p':
+                if (strcmp(optarg, "lru") == 0) {
+                    policy = CachePolicy::LRU;
+                } else if (strcmp(optarg, "2q") == 0) {
+                    policy = CachePolicy::TWO_Q;
+                } else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'i':
+                wb.interval_ms = atoi(optarg);
+                break;
+            case 'e':
+                wb.expire_ms = atoi(optarg);
+                break;
+            case 'r':
+                wb.dirty_ratio = atoi(optarg);
+                break;
+            case 'x':
+                fmt.extents = true;
+                break;
+            case 'd':
+                fmt.dir_index = true;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (wb.interval_ms == 0 or wb.dirty_ratio == 0 or wb.dirty_ratio > 100) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    Disk disk("disk.img", backend);
+    printf("Disk I/O engine: %s\n", disk.engine());
+    Cache cache(disk, 8 * BLOCK_SIZE, 0, policy);
+    Ext2m::Ext2m ext2fs(cache, fmt);
     VFS vfs(ext2fs);
     _vfsp = &vfs;
 
-    std::thread([&]() {
-        while (true) {
-            sleep(10);
-            mtx.lock();
-            vfs.sync();
-            mtx.unlock();
-        }
-    }).detach();
+    // Every expire_ms the flusher syncs the whole file system, so inodes and free counters follow the bitmaps to the disk.
+    cache.start_writeback(wb, [&]() {
+        mtx.lock();
+        vfs.sync();
+        mtx.unlock();
+    });
+    printf("Writeback: every %u ms, expire %u ms, dirty ratio %u%%\n", wb.interval_ms, wb.expire_ms, wb.dirty_ratio);
 
     std::string port = "60000";
 
-    if (argc > 1) {
-        port = argv[1];
+    if (optind < argc) {
+        port = argv[optind];
     }
 
     auto LogPrinter = [](const std::string& strLogMsg) {
@@ -2,11 +2,15 @@
 #define __SHELL_H__
 
 #include "vfs.hpp"
-#include <mutex>
+#include <shared_mutex>
 
+/**
+ * @brief Commands that only look at the file system (ls, cat, cd, df) share the lock,
+ * everything that changes it takes the lock exclusively.
+ */
 class Shell
 {
-    std::mutex &_mtx;
+    std::shared_timed_mutex &_mtx;
     VFS &_vfs;
 
     std::string _pwd;
@@ -29,7 +33,7 @@ class Shell
     }
 
 public:
-    Shell(VFS &vfs, std::mutex &mtx) : _vfs(vfs), _mtx(mtx)
+    Shell(VFS &vfs, std::shared_timed_mutex &mtx) : _vfs(vfs), _mtx(mtx)
     {
         _pwd = "/";
     }
@@ -46,9 +50,9 @@ public:
     std::string cd(const std::string &dir)
     {
         auto abs_dir = to_abs(dir);
-        _mtx.lock();
+        _mtx.lock_shared();
         auto ret = _vfs.exists(abs_dir.c_str());
-        _mtx.unlock();
+        _mtx.unlock_shared();
         if (ret == -1)
         {
             return "cd: " + dir + ": No such file or directory";
@@ -65,30 +69,37 @@ public:
     std::string ls(const std::string &dir)
     {
         auto abs_dir = to_abs(dir);
-        _mtx.lock();
+        _mtx.lock_shared();
         auto ret = _vfs.ls(abs_dir.c_str());
-        _mtx.unlock();
+        _mtx.unlock_shared();
         if (ret.empty())
         {
             return "ls: " + dir + ": No such file or directory";
         }
         return ret;
     }
+    std::string df()
+    {
+        _mtx.lock_shared();
+        auto ret = _vfs.df();
+        _mtx.unlock_shared();
+        return ret;
+    }
     std::string cat(const std::string &file_path)
     {
         auto abs_file = to_abs(file_path);
         char buf[2048];
         memset(buf, 0, sizeof(buf));
-        _mtx.lock();
+        _mtx.lock_shared();
         int fd = _vfs.open(abs_file.c_str(), O_RDONLY);
         if (fd == -1)
         {
-            _mtx.unlock();
+            _mtx.unlock_shared();
             return "cat: " + file_path + ": No such file or directory";
         }
         _vfs.read(fd, buf, sizeof(buf));
         _vfs.close(fd);
-        _mtx.unlock();
+        _mtx.unlock_shared();
         return buf;
     }
 
@@ -7,48 +7,54 @@
 #include <iostream>
 #include <fcntl.h>
 #include <ctime>
+#include <deque>
+#include <map>
+#include <mutex>
 
 class VFS
 {
     std::string _cwd;
     uint8_t _buf[BLOCK_SIZE];
     Ext2m::Ext2m &_ext2;
-    bool _find_dir_from_inode_new_create_flag;
 
-    ssize_t find_dir_from_inode(uint32_t inode_idx, const std::string &name, bool creat = false)
+    /**
+     * @brief Look up name in directory inode_idx, creating it as a directory if creat is set.
+     * @param created set to whether the directory was created by this call, if not null
+     */
+    ssize_t find_dir_from_inode(uint32_t inode_idx, const std::string &name, bool creat = false, bool *created = nullptr)
     {
-        _find_dir_from_inode_new_create_flag = false;
-        auto entrys = _ext2.get_inode_all_entry(inode_idx);
-        for (auto &&j : entrys)
-        {
-            if (j.name == name)
-            {
-                return j.inode;
-            }
-        }
+        if (created)
+            *created = false;
+        auto found = _ext2.lookup_entry(inode_idx, name);
+        if (found != 0)
+            return found;
         if (not creat)
             return -1;
 
-        auto newid = _ext2.ialloc();
+        auto newid = _ext2.ialloc(inode_idx, true);
         if (newid == 0)
             return -1;
-        size_t group = newid / _ext2.inodes_per_group;
         ext2_inode inode;
         // TODO: UID, GID, mode
         _ext2.init_inode(inode, EXT2_S_IFDIR | 0755, 0, 0);
-        inode.i_block[0] = _ext2.ballocs(group, 1).front();
         _ext2.write_inode(newid, inode);
+        auto block = _ext2.add_block_to_inode(newid); // near the new directory's inode table
 
         memset(_buf, 0, BLOCK_SIZE);
         _ext2.init_entry_block(_buf, newid, inode_idx);
-        _ext2._disk.write_block(inode.i_block[0], _buf);
+        _ext2._disk.write_block(block, _buf);
 
         Ext2m::entry e;
         e.file_type = EXT2_FT_DIR;
         e.inode = newid;
         e.name = name;
-        _ext2.add_entry_to_inode(inode_idx, e);
-        _find_dir_from_inode_new_create_flag = true;
+        if (not _ext2.add_entry_to_inode(inode_idx, e))
+        {
+            _ext2.ifree(newid);
+            return -1;
+        }
+        if (created)
+            *created = true;
         return newid;
     }
 
@@ -57,14 +63,16 @@ class VFS
         assert(absolute_path[0] == '/');
         auto &&paths = split(absolute_path, "/");
         uint32_t inode_idx = ROOT_INODE;
+        bool created = false;
         for (auto &&i : paths)
         {
-            auto idx = find_dir_from_inode(inode_idx, i, true);
-            if (idx == -1 or _find_dir_from_inode_new_create_flag == false)
+            auto idx = find_dir_from_inode(inode_idx, i, true, &created);
+            if (idx == -1)
                 return -1;
             inode_idx = idx;
         }
-        return 0;
+        // the parents may exist already, the directory itself must not
+        return created ? 0 : -1;
     }
 
     int create_file_from_root(const char *absolute_path)
@@ -86,7 +94,7 @@ class VFS
         auto idx = find_dir_from_inode(inode_idx, file_name);
         if (idx != -1)
             return -1;
-        auto nid = _ext2.ialloc();
+        auto nid = _ext2.ialloc(inode_idx);
         if (nid == 0)
             return -1;
         ext2_inode inode;
@@ -96,7 +104,11 @@ class VFS
         e.file_type = EXT2_FT_REG_FILE;
         e.inode = nid;
         e.name = file_name;
-        _ext2.add_entry_to_inode(inode_idx, e);
+        if (not _ext2.add_entry_to_inode(inode_idx, e))
+        {
+            _ext2.ifree(nid);
+            return -1;
+        }
 
         return 0;
     }
@@ -172,7 +184,9 @@ class VFS
             gmtime_s(&date, &t);
             sprintf(output, "%d-%d-%d %d:%d:%d", date.tm_year + 1900, date.tm_mon + 1, date.tm_mday, date.tm_hour + 8, date.tm_min, date.tm_sec);
 #else
-            std::strftime(output, sizeof(output), "%F %T", localtime(&t));
+            struct tm date;
+            localtime_r(&t, &date);
+            std::strftime(output, sizeof(output), "%F %T", &date);
 #endif
             sprintf(buf, "%-10d %-10s %20s %10d %15s\n", i.inode, type.c_str(), output, inode.i_size, i.name.c_str());
             ret += buf;
@@ -215,7 +229,7 @@ class VFS
         }
         if (!delable)
             return -1;
-        _ext2.free_entry_to_inode(father_inode, inode_idx);
+        _ext2.free_entry_to_inode(father_inode, inode_idx, paths.back());
         _ext2.ifree(inode_idx);
         return 0;
     }
@@ -240,28 +254,46 @@ class VFS
         if (not check_regular_file(inode.i_mode))
             return -1;
 
-        _ext2.free_entry_to_inode(father_idx, inode_idx);
+        _ext2.free_entry_to_inode(father_idx, inode_idx, paths.back());
+        invalidate_bmap(inode_idx);
         _ext2.ifree(inode_idx);
         return 0;
     }
 
+    struct extent
+    {
+        uint32_t start; // first block
+        uint32_t len;
+    };
     struct file_description
     {
         uint32_t inode_idx;
         uint32_t offset;
         int flag;
+        // Sequential readahead state, in file blocks
+        uint32_t ra_next = 0;   // block after the last one read
+        uint32_t ra_window = 0; // 0 while the reads look random
+        uint32_t ra_issued = 0; // readahead was issued up to here
+        // The file blocks looked up so far, by first file block. Dropped when the file loses blocks.
+        std::map<uint32_t, extent> bmap;
     };
-    std::vector<file_description> _files;
+    // A deque never moves its elements, so a file_description reference stays valid while other sessions open files.
+    std::deque<file_description> _files;
+    std::mutex _files_mtx;
 
-    int get_avaiable_fd()
+    int get_avaiable_fd(const file_description &fdd)
     {
+        std::lock_guard<std::mutex> lock(_files_mtx);
         size_t i = 3;
         for (; i < _files.size(); i++)
         {
             if (_files[i].inode_idx == 0)
+            {
+                _files[i] = fdd;
                 return i;
+            }
         }
-        _files.push_back({0, 0, 0});
+        _files.push_back(fdd);
         return i;
     }
 
@@ -272,6 +304,124 @@ class VFS
         return _files[fd].inode_idx != 0;
     }
 
+    /**
+     * @brief Get the open file of fd.
+     * @return nullptr if fd is not open.
+     */
+    file_description *get_file(int fd)
+    {
+        std::lock_guard<std::mutex> lock(_files_mtx);
+        if (!check_fd(fd))
+            return nullptr;
+        return &_files[fd];
+    }
+
+    /**
+     * @brief Remember that the file blocks [first, first + blocks.size()) are in blocks, adjacent blocks as one extent.
+     */
+    void bmap_add(file_description &fdd, uint32_t first, const std::vector<uint32_t> &blocks)
+    {
+        size_t i = 0;
+        while (i < blocks.size())
+        {
+            size_t j = i + 1;
+            while (j < blocks.size() and blocks[j] == blocks[j - 1] + 1)
+                j++;
+            uint32_t l = first + i;
+            auto it = fdd.bmap.lower_bound(l);
+            if (it != fdd.bmap.begin())
+            {
+                auto &&prev = std::prev(it)->second;
+                if (std::prev(it)->first + prev.len == l and prev.start + prev.len == blocks[i])
+                {
+                    prev.len += j - i;
+                    i = j;
+                    continue;
+                }
+            }
+            fdd.bmap[l] = extent{blocks[i], (uint32_t)(j - i)};
+            i = j;
+        }
+    }
+
+    /**
+     * @brief The blocks of the file blocks [first, first + count) of an open file, fewer if the file ends before.
+     * Only the file blocks that were never looked up through this fd go to the index blocks.
+     */
+    std::vector<uint32_t> map_blocks(file_description &fdd, const ext2_inode &inode, uint32_t first, uint32_t count)
+    {
+        std::vector<uint32_t> ret;
+        ret.reserve(count);
+        uint32_t l = first, end = first + count;
+        while (l < end)
+        {
+            auto it = fdd.bmap.upper_bound(l);
+            if (it != fdd.bmap.begin())
+            {
+                auto &&e = *std::prev(it);
+                if (l < e.first + e.second.len)
+                {
+                    uint32_t n = std::min(end, e.first + e.second.len) - l;
+                    for (uint32_t i = 0; i < n; i++)
+                        ret.push_back(e.second.start + (l - e.first) + i);
+                    l += n;
+                    continue;
+                }
+            }
+            uint32_t gap_end = it == fdd.bmap.end() ? end : std::min(end, it->first);
+            auto &&blocks = _ext2.bmap_range(inode, l, gap_end - l);
+            bmap_add(fdd, l, blocks);
+            ret.insert(ret.end(), blocks.begin(), blocks.end());
+            if (blocks.size() < gap_end - l) // the file ends here
+                break;
+            l = gap_end;
+        }
+        return ret;
+    }
+
+    /**
+     * @brief Forget the block maps of every fd open on the inode, after it lost blocks.
+     */
+    void invalidate_bmap(uint32_t inode_idx)
+    {
+        std::lock_guard<std::mutex> lock(_files_mtx);
+        for (auto &&f : _files)
+        {
+            if (f.inode_idx == inode_idx)
+                f.bmap.clear();
+        }
+    }
+
+    /**
+     * @brief Sequential readahead, like Linux's: a read that starts where the previous one ended (or at the beginning
+     * of the file) grows the window, READAHEAD_INIT doubling up to READAHEAD_MAX blocks, anything else resets it.
+     * The next window is loaded in the background once less than half of it is left ahead of the reader.
+     *
+     * @param fdd the open file
+     * @param inode the file's inode
+     * @param first first file block of this read
+     * @param last one past the last file block of this read
+     */
+    void readahead(file_description &fdd, const ext2_inode &inode, uint32_t first, uint32_t last)
+    {
+        uint32_t nblocks = Ext2m::ceil(inode.i_size, BLOCK_SIZE);
+        bool sequential = (first == 0 and fdd.ra_next == 0) or first == fdd.ra_next or first + 1 == fdd.ra_next;
+        fdd.ra_next = last;
+        if (not sequential)
+        {
+            fdd.ra_window = 0;
+            fdd.ra_issued = 0;
+            return;
+        }
+        fdd.ra_window = fdd.ra_window == 0 ? READAHEAD_INIT : std::min(fdd.ra_window * 2, READAHEAD_MAX);
+        uint32_t from = std::max(last, fdd.ra_issued);
+        if (from >= nblocks or from - last >= fdd.ra_window / 2)
+            return;
+        uint32_t to = std::min<uint32_t>(last + fdd.ra_window, nblocks);
+        _ext2._disk.readahead(map_blocks(fdd, inode, from, to - from));
+        fdd.ra_issued = to;
+    }
+
     bool check_writeable(int flag)
     {
         if ((flag & O_ACCMODE) == O_RDONLY)
@@ -312,7 +462,7 @@ class VFS
 
     int open_file_from_root(const char *absolute_path, int flag)
     {
-        // flag : O_RDONLY, O_WRONLY, O_RDWR
+        // flag : O_RDONLY, O_WRONLY, O_RDWR, with O_TRUNC
         // check if flag contains O_CREAT
 
         assert(absolute_path[0] == '/');
@@ -332,10 +482,18 @@ class VFS
         _ext2.get_inode(inode_idx, inode);
         if (not check_regular_file(inode.i_mode))
             return -1;
+        if ((flag & O_TRUNC) and check_writeable(flag))
+        {
+            invalidate_bmap(inode_idx);
+            _ext2.truncate_blocks(inode_idx, 0);
+            _ext2.get_inode(inode_idx, inode);
+            inode.i_size = 0;
+            inode.i_mtime = time(NULL);
+            _ext2.write_inode(inode_idx, inode);
+        }
         _fdd.offset = 0;
-        auto fd = get_avaiable_fd();
-        _files[fd] = _fdd;
-        return fd;
+        _ext2.iget(inode_idx);
+        return get_avaiable_fd(_fdd);
     }
 
     int mv_from_root(const char *old_path, const char *new_path)
@@ -358,14 +516,8 @@ class VFS
         auto rname = npath.back();
         npath.pop_back();
 
-        auto all_entrys = _ext2.get_inode_all_entry(father_idx);
-        for (auto &&i : all_entrys)
-        {
-            if (i.name == rname)
-            {
-                return -1;
-            }
-        }
+        if (_ext2.lookup_entry(father_idx, rname) != 0)
+            return -1;
 
         uint32_t target_inode_idx = ROOT_INODE;
         for (auto &&i : npath)
@@ -379,7 +531,7 @@ class VFS
         ext2_inode inode;
         _ext2.get_inode(inode_idx, inode);
 
-        _ext2.free_entry_to_inode(father_idx, inode_idx);
+        _ext2.free_entry_to_inode(father_idx, inode_idx, paths.back());
 
         Ext2m::entry e;
         if (check_regular_file(inode.i_mode))
@@ -391,7 +543,14 @@ class VFS
         e.inode = inode_idx;
         e.name = rname;
 
-        _ext2.add_entry_to_inode(target_inode_idx, e);
+        if (not _ext2.add_entry_to_inode(target_inode_idx, e))
+        {
+            // the old entry goes back where it was
+            e.name = paths.back();
+            bool flag = _ext2.add_entry_to_inode(father_idx, e);
+            assert(flag);
+            return -1;
+        }
         return 0;
     }
 
@@ -414,7 +573,7 @@ public:
     int open(const char *path, int flags)
     {
         auto str = to_absolute_path(path);
-        if ((flags & ~O_ACCMODE) == O_CREAT)
+        if (flags & O_CREAT)
         {
             create(path);
         }
@@ -422,8 +581,14 @@ public:
     }
     int close(int fd)
     {
+        std::lock_guard<std::mutex> lock(_files_mtx);
         if (!check_fd(fd))
             return -1;
+        // Files are only opened for writing with the file system locked exclusively, so this does not race with other writers.
+        if (check_writeable(_files[fd].flag))
+            _ext2.discard_reservation(_files[fd].inode_idx);
+        _ext2.iput(_files[fd].inode_idx);
+        _files[fd].bmap.clear();
         _files[fd].inode_idx = 0;
         _files[fd].flag = 0;
         _files[fd].offset = 0;
@@ -431,17 +596,24 @@ public:
     }
     ssize_t read(int fd, void *buf, size_t count)
     {
-        if (!check_fd(fd))
+        auto *file = get_file(fd);
+        if (file == nullptr)
             return -1;
         if (count == 0)
             return 0;
-        auto &&_fd = _files[fd];
+        auto &&_fd = *file;
         if (not check_readable(_fd.flag))
             return -1;
         ext2_inode inode;
         _ext2.get_inode(_fd.inode_idx, inode);
-        inode.i_atime = time(NULL);
-        _ext2.write_inode(_fd.inode_idx, inode);
+        // relatime: the access time only moves past a change, or once it is RELATIME_INTERVAL old,
+        // so reading a file does not dirty its inode every time.
+        uint32_t now = time(NULL);
+        if (inode.i_atime <= inode.i_mtime or inode.i_atime <= inode.i_ctime or now - inode.i_atime >= RELATIME_INTERVAL)
+        {
+            inode.i_atime = now;
+            _ext2.write_inode(_fd.inode_idx, inode);
+        }
         if (_fd.offset >= inode.i_size)
             return 0;
         size_t real_read_size = 0;
@@ -449,49 +621,52 @@ public:
             real_read_size = inode.i_size - _fd.offset;
         else
             real_read_size = count;
-        auto &&all_blocks = _ext2.get_inode_all_blocks(_fd.inode_idx);
-
-        auto start_block = _fd.offset / BLOCK_SIZE;
-        auto start_offset = _fd.offset % BLOCK_SIZE;
-        auto end_block = (_fd.offset + real_read_size) / BLOCK_SIZE;
-        auto end_offset = (_fd.offset + real_read_size) % BLOCK_SIZE;
-
-        if (start_block == end_block)
+        // only the blocks of this read are looked up
+        uint32_t first = _fd.offset / BLOCK_SIZE;
+        uint32_t last = (_fd.offset + real_read_size - 1) / BLOCK_SIZE + 1;
+        auto &&blocks = map_blocks(_fd, inode, first, last - first);
+        assert(blocks.size() == last - first);
+        readahead(_fd, inode, first, last);
+
+        uint8_t block[BLOCK_SIZE]; // reads may run concurrently, so not _buf
+        uint8_t *dst = (uint8_t *)buf;
+        size_t pos = _fd.offset;
+        size_t end = _fd.offset + real_read_size;
+        // unaligned head
+        if (pos % BLOCK_SIZE != 0)
         {
-            _ext2._disk.read_block(all_blocks[start_block], _buf);
-            memcpy(buf, _buf + start_offset, real_read_size);
+            size_t n = std::min<size_t>(BLOCK_SIZE - pos % BLOCK_SIZE, end - pos);
+            _ext2._disk.read_block(blocks[pos / BLOCK_SIZE - first], block);
+            memcpy(dst, block + pos % BLOCK_SIZE, n);
+            dst += n;
+            pos += n;
         }
-        else
+        // whole blocks straight into the caller's buffer, adjacent blocks are read together
+        size_t full = (end - pos) / BLOCK_SIZE;
+        if (full > 0)
         {
-            for (auto i = start_block; i <= end_block; i++)
-            {
-                _ext2._disk.read_block(all_blocks[i], _buf);
-                if (i == start_block)
-                {
-                    memcpy(buf, _buf + start_offset, BLOCK_SIZE - start_offset);
-                    buf = (uint8_t *)buf + BLOCK_SIZE - start_offset;
-                }
-                else if (i == end_block)
-                {
-                    memcpy(buf, _buf, end_offset);
-                }
-                else
-                {
-                    memcpy(buf, _buf, BLOCK_SIZE);
-                    buf = (uint8_t *)buf + BLOCK_SIZE;
-                }
-            }
+            _ext2._disk.readv_blocks(blocks.data() + pos / BLOCK_SIZE - first, full, dst);
+            dst += full * BLOCK_SIZE;
+            pos += full * BLOCK_SIZE;
+        }
+        // unaligned tail
+        if (pos < end)
+        {
+            _ext2._disk.read_block(blocks[pos / BLOCK_SIZE - first], block);
+            memcpy(dst, block, end - pos);
         }
 
+        _fd.offset += real_read_size;
         return real_read_size;
     }
     ssize_t write(int fd, const void *buf, uint32_t count)
     {
-        if (!check_fd(fd))
+        auto *file = get_file(fd);
+        if (file == nullptr)
             return -1;
         if (count == 0)
             return 0;
-        auto &&_fd = _files[fd];
+        auto &&_fd = *file;
         if (not check_writeable(_fd.flag))
             return -1;
         auto inode_idx = _fd.inode_idx;
@@ -503,90 +678,87 @@ public:
         inode.i_mtime = time(NULL);
         _ext2.write_inode(inode_idx, inode);
 
-        auto &&all_blocks = _ext2.get_inode_all_blocks(inode_idx);
-
-        auto start_block = offset / BLOCK_SIZE;
-        auto start_offset = offset % BLOCK_SIZE;
-        auto end_block = (offset + count) / BLOCK_SIZE;
-        auto end_offset = (offset + count) % BLOCK_SIZE;
         // TODO :SPARSE FILE SUPPORT
-
-        if (end_block >= all_blocks.size())
+        // the blocks of this write, those the file already has are looked up, the rest is appended
+        uint32_t first = offset / BLOCK_SIZE;
+        uint32_t need = Ext2m::ceil(offset + count, BLOCK_SIZE);
+        uint32_t last_block;
+        uint32_t have = _ext2.count_blocks_of_inode(inode, last_block);
+        std::vector<uint32_t> blocks;
+        if (first < have)
+            blocks = map_blocks(_fd, inode, first, std::min(need, have) - first);
+        if (need > have)
         {
-            int cnt = end_block - all_blocks.size() + 1;
-            while (cnt--)
-            {
-                _ext2.add_block_to_inode(inode_idx);
-            }
-            all_blocks = _ext2.get_inode_all_blocks(inode_idx);
+            auto &&added = _ext2.add_blocks_to_inode(inode_idx, need - have, true);
+            bmap_add(_fd, have, added);
+            blocks.insert(blocks.end(), added.begin() + (std::max(first, have) - have), added.end());
         }
+        assert(blocks.size() == need - first);
 
-        if (start_block == end_block)
+        const uint8_t *src = (const uint8_t *)buf;
+        size_t pos = offset;
+        size_t end = offset + count;
+        // unaligned head, read-modify-write
+        if (pos % BLOCK_SIZE != 0 or end - pos < BLOCK_SIZE)
         {
-            _ext2._disk.read_block(all_blocks[start_block], _buf);
-            memcpy(_buf + start_offset, buf, count);
-            _ext2._disk.write_block(all_blocks[start_block], _buf);
+            size_t n = std::min<size_t>(BLOCK_SIZE - pos % BLOCK_SIZE, end - pos);
+            auto &&block = blocks[pos / BLOCK_SIZE - first];
+            _ext2._disk.read_block(block, _buf);
+            memcpy(_buf + pos % BLOCK_SIZE, src, n);
+            _ext2._disk.write_block(block, _buf);
+            src += n;
+            pos += n;
         }
-        else
+        // whole blocks are overwritten without reading them, adjacent blocks are written together
+        size_t full = (end - pos) / BLOCK_SIZE;
+        if (full > 0)
         {
-            for (size_t i = start_block; i <= end_block; i++)
-            {
-                auto &&block = all_blocks[i];
-
-                if (i == start_block)
-                {
-                    _ext2._disk.read_block(block, _buf);
-                    memcpy(_buf + start_offset, buf, BLOCK_SIZE - start_offset);
-                    _ext2._disk.write_block(block, _buf);
-                    buf = (uint8_t *)(buf) + BLOCK_SIZE - start_offset;
-                }
-                else if (i == end_block)
-                {
-                    _ext2._disk.read_block(block, _buf);
-                    memcpy(_buf, buf, end_offset);
-                    _ext2._disk.write_block(block, _buf);
-                }
-                else
-                {
-                    _ext2._disk.read_block(block, _buf);
-                    memcpy(_buf, buf, BLOCK_SIZE);
-                    _ext2._disk.write_block(block, _buf);
-                    buf = (uint8_t *)(buf) + BLOCK_SIZE;
-                }
-            }
+            _ext2._disk.writev_blocks(blocks.data() + pos / BLOCK_SIZE - first, full, src);
+            src += full * BLOCK_SIZE;
+            pos += full * BLOCK_SIZE;
+        }
+        // unaligned tail, read-modify-write
+        if (pos < end)
+        {
+            auto &&block = blocks[pos / BLOCK_SIZE - first];
+            _ext2._disk.read_block(block, _buf);
+            memcpy(_buf, src, end - pos);
+            _ext2._disk.write_block(block, _buf);
         }
         _fd.offset += count;
         return count;
     }
     off_t lseek(int fd, off_t offset, int whence)
     {
-        if (!check_fd(fd))
+        auto *file = get_file(fd);
+        if (file == nullptr)
             return -1;
         ext2_inode inode;
-        auto inode_idx = _files[fd].inode_idx;
+        auto inode_idx = file->inode_idx;
         _ext2.get_inode(inode_idx, inode);
         switch (whence)
         {
         case SEEK_SET:
-            _files[fd].offset = offset;
+            file->offset = offset;
             break;
         case SEEK_CUR:
-            _files[fd].offset += offset;
+            file->offset += offset;
             break;
         case SEEK_END:
-            _files[fd].offset = inode.i_size + offset;
+            file->offset = inode.i_size + offset;
             break;
         default:
             return -1;
         }
-        return _files[fd].offset;
+        return file->offset;
     }
     int fstat(int fd, struct stat *buf)
     {
-        if (!check_fd(fd))
+        auto *file = get_file(fd);
+        if (file == nullptr)
             return -1;
         ext2_inode inode;
-        auto inode_idx = _files[fd].inode_idx;
+        auto inode_idx = file->inode_idx;
         _ext2.get_inode(inode_idx, inode);
         buf->st_ino = inode_idx;
         buf->st_mode = inode.i_mode;
@@ -640,6 +812,31 @@ public:
         return ls_from_root(dir.c_str());
     }
 
+    /**
+     * @brief Free blocks and inodes of each block group and of the whole file system.
+     * Reads the in-memory counters only, no bitmap is scanned.
+     */
+    std::string df()
+    {
+        std::string ret;
+        char buf[256];
+        sprintf(buf, "%-10s %15s %15s %10s\n", "group", "free blocks", "free inodes", "dirs");
+        ret += buf;
+        sprintf(buf, "------------------------------------------------------\n");
+        ret += buf;
+        for (size_t i = 0; i < _ext2.group_count(); i++)
+        {
+            auto &&desc = _ext2.group_desc(i);
+            sprintf(buf, "%-10zu %15u %15u %10u\n", i, (unsigned)desc.bg_free_blocks_count, (unsigned)desc.bg_free_inodes_count, (unsigned)desc.bg_used_dirs_count);
+            ret += buf;
+        }
+        auto &&sb = _ext2.super_block();
+        sprintf(buf, "blocks: %u free of %u (%u KB free)\ninodes: %u free of %u\n", sb.s_free_blocks_count, sb.s_blocks_count,
+                sb.s_free_blocks_count * (unsigned)(BLOCK_SIZE / KB), sb.s_free_inodes_count, sb.s_inodes_count);
+        ret += buf;
+        return ret;
+    }
+
     int rmdir(const char *path)
     {
         auto dir = to_absolute_path(path);